@@ -0,0 +1,74 @@
+#!/usr/bin/env bash
+# Compares the /dev/fuse and io_uring transports on a metadata-heavy
+# workload: rounds of open, fstat and close over a few files. With cached
+# entries every round is three FUSE requests (open, flush, release) that are
+# answered locally, so the numbers reflect the transport rather than the
+# server. Reports rounds per second and round latency percentiles.
+#
+# usage: ci/bench_transport.sh [build dir] [rounds] [extra -o options]
+set -euo pipefail
+IFS=$'\n\t'
+
+build=${1:-build}
+rounds=${2:-20000}
+extra=${3:-}
+
+if [[ -z "${NETWORKFS_TOKEN:-}" ]]; then
+  echo "NETWORKFS_TOKEN is not set"
+  exit 2
+fi
+
+mnt=$(mktemp -d)
+log=$(mktemp)
+trap 'fusermount3 -u "$mnt" 2>/dev/null || true; rmdir "$mnt"; rm -f "$log"' EXIT
+
+run() {
+  local name=$1 opts=$2
+  "$build/networkfs" -f -o "cache_ttl=3600${opts:+,$opts}${extra:+,$extra}" \
+    "$mnt" >"$log" 2>&1 &
+  local pid=$!
+  for _ in $(seq 50); do
+    mountpoint -q "$mnt" && break
+    sleep 0.1
+  done
+
+  python3 - "$mnt" "$rounds" "$name" <<'EOF'
+import os
+import sys
+import time
+
+mnt, rounds, name = sys.argv[1], int(sys.argv[2]), sys.argv[3]
+paths = [os.path.join(mnt, "bench%d" % i) for i in range(8)]
+for path in paths:
+    os.close(os.open(path, os.O_CREAT | os.O_RDWR))
+
+latencies = []
+try:
+    start = time.perf_counter_ns()
+    for i in range(rounds):
+        t = time.perf_counter_ns()
+        fd = os.open(paths[i % len(paths)], os.O_RDONLY)
+        os.fstat(fd)
+        os.close(fd)
+        latencies.append(time.perf_counter_ns() - t)
+    total = time.perf_counter_ns() - start
+finally:
+    # The files live on the server, which outlives the mount
+    for path in paths:
+        os.unlink(path)
+
+latencies.sort()
+def pct(p):
+    return latencies[min(len(latencies) - 1, len(latencies) * p // 100)] / 1000
+print("%-9s %9.0f rounds/s  p50 %7.1f us  p99 %7.1f us" %
+      (name, rounds / (total / 1e9), pct(50), pct(99)))
+EOF
+
+  fusermount3 -u "$mnt"
+  wait "$pid" || true
+  # libfuse and networkfs say so when io_uring falls back to /dev/fuse
+  grep -E "io.uring" "$log" | sed "s|^|$name: |" || true
+}
+
+run /dev/fuse ""
+run io_uring "io_uring"
@@ -0,0 +1,90 @@
+#include "api.h"
+
+#include <cstdio>
+#include <cstring>
+
+#include "http.h"
+#include "util.h"
+
+// Enough for every method but list.
+#define API_RESPONSE_SIZE 1024
+
+static std::string ino_arg(uint64_t ino) {
+  char ino_str[21];
+  ino_to_string(ino_str, ino);
+  return ino_str;
+}
+
+networkfs_completion<networkfs_response> networkfs_api::call(
+    const char* method, size_t response_size,
+    std::vector<std::pair<std::string, std::string>> args) const {
+  return networkfs_completion<networkfs_response>(
+      [token = token, async = async, method, response_size,
+       args = std::move(args)](
+          networkfs_completion<networkfs_response>::callback done) {
+        if (async) {
+          networkfs_http_call_async(
+              token, method, response_size, args,
+              [response_size, done](int64_t result, const char* response) {
+                done({result,
+                      std::vector<char>(response, response + response_size)});
+              });
+          return;
+        }
+
+        std::vector<char> response(response_size);
+        int64_t result = networkfs_http_call(token, method, response.data(),
+                                             response.size(), args);
+        done({result, std::move(response)});
+      });
+}
+
+networkfs_completion<networkfs_response> networkfs_api::lookup(
+    uint64_t parent, std::string_view name) const {
+  return call("lookup", API_RESPONSE_SIZE,
+              {{"parent", ino_arg(parent)}, {"name", std::string(name)}});
+}
+
+networkfs_completion<networkfs_response> networkfs_api::list(
+    uint64_t ino) const {
+  return call("list", sizeof(struct entries), {{"inode", ino_arg(ino)}});
+}
+
+networkfs_completion<networkfs_response> networkfs_api::read(
+    uint64_t ino) const {
+  return call("read", API_RESPONSE_SIZE, {{"inode", ino_arg(ino)}});
+}
+
+networkfs_completion<networkfs_response> networkfs_api::write(
+    uint64_t ino, std::string_view content) const {
+  return call("write", API_RESPONSE_SIZE,
+              {{"inode", ino_arg(ino)}, {"content", std::string(content)}});
+}
+
+networkfs_completion<networkfs_response> networkfs_api::create(
+    uint64_t parent, std::string_view name, const char* type) const {
+  return call("create", API_RESPONSE_SIZE,
+              {{"parent", ino_arg(parent)},
+               {"name", std::string(name)},
+               {"type", type}});
+}
+
+networkfs_completion<networkfs_response> networkfs_api::unlink(
+    uint64_t parent, std::string_view name) const {
+  return call("unlink", API_RESPONSE_SIZE,
+              {{"parent", ino_arg(parent)}, {"name", std::string(name)}});
+}
+
+networkfs_completion<networkfs_response> networkfs_api::rmdir(
+    uint64_t parent, std::string_view name) const {
+  return call("rmdir", API_RESPONSE_SIZE,
+              {{"parent", ino_arg(parent)}, {"name", std::string(name)}});
+}
+
+networkfs_completion<networkfs_response> networkfs_api::link(
+    uint64_t source, uint64_t parent, std::string_view name) const {
+  return call("link", API_RESPONSE_SIZE,
+              {{"source", ino_arg(source)},
+               {"parent", ino_arg(parent)},
+               {"name", std::string(name)}});
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "task.h"
+
+// Payload of fs/lookup and fs/create.
+struct entry_info {
+  uint64_t entry_type;
+  uint64_t ino;
+};
+
+struct entry {
+  uint64_t entry_type;
+  uint64_t ino;
+  char name[256];
+};
+
+// Payload of fs/list.
+struct entries {
+  uint64_t entries_count;
+  struct entry entries[16];
+};
+
+/*
+ * networkfs_response - outcome of an API call.
+ * @result: Same as the return value of networkfs_http_call().
+ * @data:   Response payload, zero-padded to the size the method asks for.
+ */
+struct networkfs_response {
+  int64_t result;
+  std::vector<char> data;
+};
+
+/*
+ * Awaitable calls to the networkfs API, e.g.
+ *
+ *   networkfs_response r = co_await api.lookup(parent, name);
+ *
+ * With @async the call goes through networkfs_http_call_async(): the
+ * awaiting coroutine suspends and is resumed by networkfs_http_process()
+ * once the response arrives. Otherwise the call blocks and the coroutine
+ * goes on without suspending.
+ */
+struct networkfs_api {
+  const char* token;
+  bool async;
+
+  /**
+   * call - call API @method.
+   * @method:        API method name, e.g. "list" for fs.list.
+   * @response_size: Maximum accepted size of the response payload.
+   * @args:          GET parameters.
+   */
+  networkfs_completion<networkfs_response> call(
+      const char* method, size_t response_size,
+      std::vector<std::pair<std::string, std::string>> args) const;
+
+  networkfs_completion<networkfs_response> lookup(uint64_t parent,
+                                                  std::string_view name) const;
+  networkfs_completion<networkfs_response> list(uint64_t ino) const;
+  networkfs_completion<networkfs_response> read(uint64_t ino) const;
+  networkfs_completion<networkfs_response> write(
+      uint64_t ino, std::string_view content) const;
+  // @type is "file" or "directory".
+  networkfs_completion<networkfs_response> create(uint64_t parent,
+                                                  std::string_view name,
+                                                  const char* type) const;
+  networkfs_completion<networkfs_response> unlink(uint64_t parent,
+                                                  std::string_view name) const;
+  networkfs_completion<networkfs_response> rmdir(uint64_t parent,
+                                                 std::string_view name) const;
+  networkfs_completion<networkfs_response> link(uint64_t source,
+                                                uint64_t parent,
+                                                std::string_view name) const;
+};
@@ -0,0 +1,258 @@
+#include "cache.h"
+
+#include <dirent.h>
+
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+
+// Expired entries are swept once the cache grows beyond this many names.
+#define CACHE_SWEEP_THRESHOLD 4096
+
+using cache_clock = std::chrono::steady_clock;
+
+struct cached_dentry {
+  struct networkfs_dentry dentry;
+  cache_clock::time_point expires;
+};
+
+struct cached_attr {
+  struct networkfs_attr attr;
+  cache_clock::time_point expires;
+};
+
+/*
+ * Names are ordered by parent first, so everything cached under one
+ * directory forms a contiguous range.
+ */
+using dentry_key = std::pair<uint64_t, std::string>;
+
+static struct {
+  std::mutex mutex;
+  double ttl = 1.0;
+  std::map<dentry_key, cached_dentry> dentries;
+  std::unordered_map<uint64_t, cached_attr> attrs;
+  // Directories whose every name is in @dentries, and until when: never past
+  // the expiry of any name listed, so a listed name cannot look absent.
+  std::unordered_map<uint64_t, cache_clock::time_point> complete;
+  size_t sweep_at = CACHE_SWEEP_THRESHOLD;
+} cache;
+
+static cache_clock::time_point cache_deadline() {
+  return cache_clock::now() +
+         std::chrono::duration_cast<cache_clock::duration>(
+             std::chrono::duration<double>(cache.ttl));
+}
+
+// Drops expired records once the maps have grown past the sweep threshold.
+static void cache_sweep() {
+  if (cache.dentries.size() + cache.attrs.size() < cache.sweep_at) {
+    return;
+  }
+  auto now = cache_clock::now();
+  auto expired = [now](const auto& item) { return item.second.expires <= now; };
+  std::erase_if(cache.dentries, expired);
+  std::erase_if(cache.attrs, expired);
+  std::erase_if(cache.complete,
+                [now](const auto& item) { return item.second <= now; });
+  cache.sweep_at = std::max<size_t>(
+      CACHE_SWEEP_THRESHOLD, (cache.dentries.size() + cache.attrs.size()) * 2);
+}
+
+static struct timespec cache_now() {
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  return now;
+}
+
+/*
+ * Returns the live attribute record of @ino, creating a fresh one of
+ * @entry_type if there is none or the type has changed.
+ */
+static cached_attr& cache_attr(uint64_t ino, uint64_t entry_type) {
+  auto [it, inserted] = cache.attrs.try_emplace(ino);
+  cached_attr& cached = it->second;
+  if (inserted || cached.expires <= cache_clock::now() ||
+      cached.attr.entry_type != entry_type) {
+    cached.attr.entry_type = entry_type;
+    cached.attr.size = entry_type == DT_DIR ? 0 : NETWORKFS_SIZE_UNKNOWN;
+    cached.attr.nlink = entry_type == DT_DIR ? 2 : 1;
+    cached.attr.mtime = cache_now();
+    cached.expires = cache_deadline();
+  }
+  return cached;
+}
+
+void networkfs_cache_configure(double ttl) {
+  std::lock_guard<std::mutex> lock(cache.mutex);
+  cache.ttl = ttl > 0 ? ttl : 0;
+  cache.dentries.clear();
+  cache.attrs.clear();
+  cache.complete.clear();
+}
+
+double networkfs_cache_ttl() {
+  std::lock_guard<std::mutex> lock(cache.mutex);
+  return cache.ttl;
+}
+
+// networkfs_dentry_get() with @cache.mutex held.
+static bool cache_dentry_get(uint64_t parent, const char* name,
+                             struct networkfs_dentry* dentry) {
+  auto now = cache_clock::now();
+  auto it = cache.dentries.find({parent, name});
+  if (it != cache.dentries.end()) {
+    if (it->second.expires > now) {
+      *dentry = it->second.dentry;
+      return true;
+    }
+    bool positive = it->second.dentry.ino != 0;
+    cache.dentries.erase(it);
+    if (positive) {
+      // The name may well still exist; only the server can tell
+      return false;
+    }
+  }
+
+  auto dir = cache.complete.find(parent);
+  if (dir == cache.complete.end()) {
+    return false;
+  }
+  if (dir->second <= now) {
+    cache.complete.erase(dir);
+    return false;
+  }
+  *dentry = {0, 0};
+  return true;
+}
+
+bool networkfs_dentry_get(uint64_t parent, const char* name,
+                          struct networkfs_dentry* dentry) {
+  std::lock_guard<std::mutex> lock(cache.mutex);
+  return cache_dentry_get(parent, name, dentry);
+}
+
+void networkfs_dentry_put(uint64_t parent, const char* name,
+                          const struct networkfs_dentry& dentry) {
+  std::lock_guard<std::mutex> lock(cache.mutex);
+  if (cache.ttl == 0) {
+    return;
+  }
+  cache.dentries.insert_or_assign({parent, name},
+                                  cached_dentry{dentry, cache_deadline()});
+  if (dentry.ino != 0) {
+    cache_attr(dentry.ino, dentry.entry_type);
+  }
+  cache_sweep();
+}
+
+void networkfs_dentry_offer(uint64_t parent, const char* name,
+                            const struct networkfs_dentry& dentry) {
+  std::lock_guard<std::mutex> lock(cache.mutex);
+  struct networkfs_dentry known;
+  if (cache.ttl == 0 || cache_dentry_get(parent, name, &known)) {
+    return;
+  }
+  cache.dentries.insert_or_assign({parent, name},
+                                  cached_dentry{dentry, cache_deadline()});
+  if (dentry.ino != 0) {
+    cache_attr(dentry.ino, dentry.entry_type);
+  }
+  cache_sweep();
+}
+
+void networkfs_dentry_drop(uint64_t parent, const char* name) {
+  std::lock_guard<std::mutex> lock(cache.mutex);
+  cache.dentries.erase({parent, name});
+  cache.complete.erase(parent);
+}
+
+void networkfs_dentry_drop_dir(uint64_t parent) {
+  std::lock_guard<std::mutex> lock(cache.mutex);
+  cache.complete.erase(parent);
+  cache.dentries.erase(cache.dentries.lower_bound({parent, ""}),
+                       cache.dentries.lower_bound({parent + 1, ""}));
+}
+
+bool networkfs_attr_get(uint64_t ino, struct networkfs_attr* attr) {
+  std::lock_guard<std::mutex> lock(cache.mutex);
+  auto it = cache.attrs.find(ino);
+  if (it == cache.attrs.end()) {
+    return false;
+  }
+  if (it->second.expires <= cache_clock::now()) {
+    cache.attrs.erase(it);
+    return false;
+  }
+  *attr = it->second.attr;
+  return true;
+}
+
+void networkfs_attr_set_type(uint64_t ino, uint64_t entry_type) {
+  std::lock_guard<std::mutex> lock(cache.mutex);
+  if (cache.ttl == 0) {
+    return;
+  }
+  cache_attr(ino, entry_type);
+  cache_sweep();
+}
+
+void networkfs_attr_set_size(uint64_t ino, uint64_t size, bool modified) {
+  std::lock_guard<std::mutex> lock(cache.mutex);
+  if (cache.ttl == 0) {
+    return;
+  }
+  cached_attr& cached = cache_attr(ino, DT_REG);
+  if (modified || (cached.attr.size != size &&
+                   cached.attr.size != NETWORKFS_SIZE_UNKNOWN)) {
+    cached.attr.mtime = cache_now();
+  }
+  cached.attr.size = size;
+  // The size is fresh information, so it gets a full lifetime.
+  cached.expires = cache_deadline();
+  cache_sweep();
+}
+
+bool networkfs_attr_link(uint64_t ino, int delta) {
+  std::lock_guard<std::mutex> lock(cache.mutex);
+  auto it = cache.attrs.find(ino);
+  if (it == cache.attrs.end()) {
+    return false;
+  }
+  struct networkfs_attr& attr = it->second.attr;
+  if (delta < 0 && attr.nlink <= 1) {
+    cache.attrs.erase(it);
+    return true;
+  }
+  attr.nlink += delta;
+  return false;
+}
+
+void networkfs_attr_drop(uint64_t ino) {
+  std::lock_guard<std::mutex> lock(cache.mutex);
+  cache.attrs.erase(ino);
+}
+
+void networkfs_dir_set_complete(uint64_t dir) {
+  std::lock_guard<std::mutex> lock(cache.mutex);
+  if (cache.ttl == 0) {
+    return;
+  }
+  cache_clock::time_point expires = cache_deadline();
+  for (auto it = cache.dentries.lower_bound({dir, ""});
+       it != cache.dentries.end() && it->first.first == dir; ++it) {
+    if (it->second.dentry.ino != 0) {
+      expires = std::min(expires, it->second.expires);
+    }
+  }
+  cache.complete.insert_or_assign(dir, expires);
+}
+
+void networkfs_dir_invalidate(uint64_t dir) {
+  std::lock_guard<std::mutex> lock(cache.mutex);
+  cache.complete.erase(dir);
+}
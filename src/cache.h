@@ -0,0 +1,175 @@
+#pragma once
+
+#include <time.h>
+
+#include <cstdint>
+
+/*
+ * Metadata cache. Remembers what the server told us about names and inodes
+ * so that repeated path walks and stat calls are answered locally. Everything
+ * expires after the configured TTL; handlers that change the namespace update
+ * the cache themselves. Inode numbers are in FUSE numbering (root is 1).
+ *
+ * All functions are thread-safe.
+ */
+
+/**
+ * struct networkfs_dentry - cached result of a name lookup.
+ * @ino:        Inode the name resolves to, or 0 for a name that is known not
+ *              to exist (a negative dentry).
+ * @entry_type: DT_DIR or DT_REG; unused for negative dentries.
+ */
+struct networkfs_dentry {
+  uint64_t ino;
+  uint64_t entry_type;
+};
+
+/**
+ * networkfs_cache_configure - set how long cached metadata stays valid.
+ * @ttl: Lifetime in seconds. 0 disables caching.
+ */
+void networkfs_cache_configure(double ttl);
+
+/**
+ * networkfs_cache_ttl - configured metadata lifetime.
+ *
+ * Return: lifetime in seconds, suitable as a FUSE entry or attr timeout.
+ */
+double networkfs_cache_ttl();
+
+/**
+ * networkfs_dentry_get - look a name up in the cache.
+ * @parent: Directory inode.
+ * @name:   Entry name.
+ * @dentry: Filled on a hit.
+ *
+ * Names missing from a directory marked complete are reported as negative
+ * dentries.
+ *
+ * Return: true if the answer is known and not yet expired.
+ */
+bool networkfs_dentry_get(uint64_t parent, const char* name,
+                          struct networkfs_dentry* dentry);
+
+/**
+ * networkfs_dentry_put - remember what @name resolves to.
+ * @parent: Directory inode.
+ * @name:   Entry name.
+ * @dentry: Lookup result.
+ *
+ * Replaces whatever was cached for @name, so creating a name locally
+ * overrides a negative dentry. A positive @dentry also records the type of
+ * the target inode in the attribute cache.
+ */
+void networkfs_dentry_put(uint64_t parent, const char* name,
+                          const struct networkfs_dentry& dentry);
+
+/**
+ * networkfs_dentry_offer - remember what @name resolved to, unless known.
+ * @parent: Directory inode.
+ * @name:   Entry name.
+ * @dentry: Lookup result.
+ *
+ * For answers that may be older than what the cache knows, like those of
+ * speculative lookups issued before a local create or unlink: the cache is
+ * only filled while it has no answer for @name.
+ */
+void networkfs_dentry_offer(uint64_t parent, const char* name,
+                            const struct networkfs_dentry& dentry);
+
+/**
+ * networkfs_dentry_drop - forget a single name.
+ * @parent: Directory inode.
+ * @name:   Entry name.
+ *
+ * The directory is no longer considered complete.
+ */
+void networkfs_dentry_drop(uint64_t parent, const char* name);
+
+/**
+ * networkfs_dentry_drop_dir - forget every name cached under a directory.
+ * @parent: Directory inode.
+ */
+void networkfs_dentry_drop_dir(uint64_t parent);
+
+/**
+ * networkfs_dir_set_complete - mark the cached names of a directory as its
+ * whole content.
+ * @dir: Directory inode.
+ *
+ * Call after putting every entry of a listing. Until the TTL runs out or
+ * networkfs_dir_invalidate() is called, lookups of other names in @dir are
+ * answered as misses without asking the server. The mark expires no later
+ * than the names cached under @dir, so a listed name never looks absent.
+ */
+void networkfs_dir_set_complete(uint64_t dir);
+
+/**
+ * networkfs_dir_invalidate - stop treating a directory as complete.
+ * @dir: Directory inode.
+ *
+ * Cached names stay valid; only misses go back to the server.
+ */
+void networkfs_dir_invalidate(uint64_t dir);
+
+// Size of a file whose content has not been seen yet.
+#define NETWORKFS_SIZE_UNKNOWN UINT64_MAX
+
+/**
+ * struct networkfs_attr - cached attributes of an inode.
+ * @entry_type: DT_DIR or DT_REG.
+ * @size:       Content length, or NETWORKFS_SIZE_UNKNOWN. The API has no way
+ *              to query it other than downloading the file, so it is only
+ *              known once the content has been read or written.
+ * @nlink:      Number of names known to refer to the inode.
+ * @mtime:      When the content was last seen to change.
+ */
+struct networkfs_attr {
+  uint64_t entry_type;
+  uint64_t size;
+  uint32_t nlink;
+  struct timespec mtime;
+};
+
+/**
+ * networkfs_attr_get - look inode attributes up in the cache.
+ * @ino:  Inode number.
+ * @attr: Filled on a hit.
+ *
+ * Return: true if @ino is cached and not yet expired.
+ */
+bool networkfs_attr_get(uint64_t ino, struct networkfs_attr* attr);
+
+/**
+ * networkfs_attr_set_type - record the type of an inode.
+ * @ino:        Inode number.
+ * @entry_type: DT_DIR or DT_REG.
+ *
+ * Known size and link count are kept if the type did not change.
+ */
+void networkfs_attr_set_type(uint64_t ino, uint64_t entry_type);
+
+/**
+ * networkfs_attr_set_size - record the content length of a file.
+ * @ino:      Inode number.
+ * @size:     Content length in bytes.
+ * @modified: Whether the content was just changed by us. Otherwise the
+ *            modification time only moves if the size differs from the
+ *            cached one.
+ */
+void networkfs_attr_set_size(uint64_t ino, uint64_t size, bool modified);
+
+/**
+ * networkfs_attr_link - adjust the link count after link or unlink.
+ * @ino:   Inode number.
+ * @delta: +1 or -1. The inode is forgotten once no names are left.
+ *
+ * Return: true if that removed the last name of a cached inode.
+ */
+bool networkfs_attr_link(uint64_t ino, int delta);
+
+/**
+ * networkfs_attr_drop - forget the attributes of an inode.
+ * @ino: Inode number.
+ */
+void networkfs_attr_drop(uint64_t ino);
@@ -0,0 +1,247 @@
+#include "content.h"
+
+#define FUSE_USE_VERSION FUSE_MAKE_VERSION(3, 17)
+#include <fuse_lowlevel.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <unordered_map>
+#include <utility>
+
+#include "inode.h"
+
+// Shared buffers of open files, by inode.
+static struct {
+  std::mutex mutex;
+  std::unordered_map<uint64_t, struct file_buffer*> buffers;
+  // Loaded buffers, most recently used first
+  std::list<struct file_buffer*> lru;
+  // Allocated content of all buffers, and how much of it to keep
+  std::atomic<size_t> bytes = 0;
+  size_t limit = SIZE_MAX;
+} open_files;
+
+void networkfs_buffer_configure(size_t limit) {
+  std::lock_guard<std::mutex> lock(open_files.mutex);
+  open_files.limit = limit;
+}
+
+/*
+ * Evicts clean content of unpinned buffers, least recently used first, until
+ * the content of open files fits the limit. Called under the table lock;
+ * buffers whose lock is taken are in use and skipped.
+ */
+static void buffer_trim() {
+  auto it = open_files.lru.end();
+  while (it != open_files.lru.begin() &&
+         open_files.bytes > open_files.limit) {
+    struct file_buffer* fb = *--it;
+    if (fb->pins > 0 || !fb->lock.try_lock()) {
+      continue;
+    }
+    if (fb->generation == fb->synced) {
+      open_files.bytes -= fb->capacity;
+      free(fb->data);
+      fb->data = nullptr;
+      fb->size = 0;
+      fb->capacity = 0;
+      fb->loaded = false;
+      it = open_files.lru.erase(it);
+    }
+    fb->lock.unlock();
+  }
+}
+
+// Frees @fb, which nothing refers to any more, under the table lock.
+static void buffer_free(struct file_buffer* fb) {
+  open_files.buffers.erase(fb->ino);
+  if (fb->loaded) {
+    open_files.lru.erase(fb->lru);
+  }
+  open_files.bytes -= fb->capacity;
+  free(fb->data);
+  delete fb;
+}
+
+struct file_buffer* networkfs_buffer_acquire(uint64_t ino) {
+  std::lock_guard<std::mutex> lock(open_files.mutex);
+  auto it = open_files.buffers.find(ino);
+  if (it != open_files.buffers.end()) {
+    it->second->refs++;
+    return it->second;
+  }
+
+  struct file_buffer* fb = new (std::nothrow) file_buffer;
+  if (fb == nullptr) {
+    return nullptr;
+  }
+  fb->ino = ino;
+  fb->refs = 1;
+  open_files.buffers.emplace(ino, fb);
+  return fb;
+}
+
+struct file_buffer* networkfs_buffer_find(uint64_t ino) {
+  std::lock_guard<std::mutex> lock(open_files.mutex);
+  auto it = open_files.buffers.find(ino);
+  if (it == open_files.buffers.end() || !it->second->loaded) {
+    return nullptr;
+  }
+  it->second->pins++;
+  return it->second;
+}
+
+void networkfs_buffer_release(struct file_buffer* fb) {
+  std::lock_guard<std::mutex> lock(open_files.mutex);
+  if (--fb->refs == 0 && fb->pins == 0) {
+    buffer_free(fb);
+  }
+}
+
+void networkfs_buffer_unpin(struct file_buffer* fb) {
+  std::lock_guard<std::mutex> lock(open_files.mutex);
+  if (--fb->pins > 0) {
+    return;
+  }
+  if (fb->refs == 0) {
+    buffer_free(fb);
+    return;
+  }
+  if (fb->loaded) {
+    open_files.lru.splice(open_files.lru.begin(), open_files.lru, fb->lru);
+    buffer_trim();
+  }
+}
+
+enum networkfs_buffer_state networkfs_buffer_load(
+    struct file_buffer* fb, std::function<void(int err)> ready) {
+  std::lock_guard<std::mutex> lock(open_files.mutex);
+  if (fb->loaded) {
+    fb->pins++;
+    return NETWORKFS_BUFFER_LOADED;
+  }
+  if (fb->loading) {
+    fb->waiting.push_back(std::move(ready));
+    return NETWORKFS_BUFFER_QUEUED;
+  }
+  fb->loading = true;
+  return NETWORKFS_BUFFER_CLAIMED;
+}
+
+void networkfs_buffer_loaded(struct file_buffer* fb, int err) {
+  std::vector<std::function<void(int err)>> waiting;
+  {
+    std::lock_guard<std::mutex> lock(open_files.mutex);
+    fb->loaded = err == 0;
+    fb->loading = false;
+    waiting.swap(fb->waiting);
+    if (fb->loaded) {
+      fb->pins++;
+      open_files.lru.push_front(fb);
+      fb->lru = open_files.lru.begin();
+      buffer_trim();
+    }
+  }
+  for (auto& ready : waiting) {
+    ready(err);
+  }
+}
+
+/*
+ * Makes room for @size bytes of content. Room grows at least twofold and
+ * starts at MAX_FILE_SIZE, so appends do not reallocate every time.
+ */
+static bool buffer_reserve(struct file_buffer* fb, size_t size) {
+  if (size <= fb->capacity) {
+    return true;
+  }
+  size_t capacity =
+      std::max({size, 2 * fb->capacity, (size_t)MAX_FILE_SIZE});
+  char* new_data = (char*)realloc(fb->data, capacity);
+  if (new_data == nullptr) {
+    return false;
+  }
+  open_files.bytes += capacity - fb->capacity;
+  fb->data = new_data;
+  fb->capacity = capacity;
+  return true;
+}
+
+bool networkfs_buffer_assign(struct file_buffer* fb, const char* data,
+                             size_t size) {
+  if (!buffer_reserve(fb, size)) {
+    return false;
+  }
+  if (size > 0) {
+    memcpy(fb->data, data, size);
+  }
+  fb->size = size;
+  return true;
+}
+
+bool networkfs_buffer_resize(struct file_buffer* fb, size_t size) {
+  if (size == fb->size) {
+    return true;
+  }
+  if (!buffer_reserve(fb, size)) {
+    return false;
+  }
+
+  // Zero out new space if expanding
+  if (size > fb->size) {
+    memset(fb->data + fb->size, 0, size - fb->size);
+  }
+
+  fb->size = size;
+  fb->generation++;
+  return true;
+}
+
+bool networkfs_buffer_write(struct file_buffer* fb, const char* data,
+                            size_t size, off_t off) {
+  size_t new_size = off + size;
+
+  // Expand buffer if needed
+  if (new_size > fb->size) {
+    if (!buffer_reserve(fb, new_size)) {
+      return false;
+    }
+    // Zero out the gap if writing beyond current size
+    if ((size_t)off > fb->size) {
+      memset(fb->data + fb->size, 0, off - fb->size);
+    }
+    fb->size = new_size;
+  }
+
+  memcpy(fb->data + off, data, size);
+  fb->generation++;
+  return true;
+}
+
+ssize_t networkfs_buffer_copy(struct file_buffer* fb, struct fuse_bufvec* src,
+                              off_t off) {
+  size_t size = fuse_buf_size(src);
+  if (!buffer_reserve(fb, off + size)) {
+    return -ENOMEM;
+  }
+  if ((size_t)off > fb->size) {
+    memset(fb->data + fb->size, 0, off - fb->size);
+  }
+
+  struct fuse_bufvec dst = {};
+  dst.count = 1;
+  dst.buf[0].mem = fb->data + off;
+  dst.buf[0].size = size;
+  ssize_t copied = fuse_buf_copy(&dst, src, (enum fuse_buf_copy_flags)0);
+  if (copied < 0) {
+    return copied;
+  }
+  fb->size = std::max(fb->size, (size_t)off + copied);
+  fb->generation++;
+  return copied;
+}
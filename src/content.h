@@ -0,0 +1,176 @@
+#pragma once
+
+#include <sys/types.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <vector>
+
+struct fuse_bufvec;
+
+/*
+ * Content of an open file, shared by every handle open on the inode. It is
+ * loaded on demand, by the first handler that needs the old bytes; handlers
+ * that need them while it is loading wait for it. The buffer is freed when
+ * the last handle is released. With `-o threads` several handlers may use
+ * it concurrently, so the content fields are only touched under @lock.
+ *
+ * Handlers pin the buffer while they use its content. When the content of
+ * all open files takes more memory than configured, clean content of
+ * buffers nobody has pinned is evicted, least recently used first, and is
+ * loaded again when next needed.
+ *
+ * @generation is bumped by every change of the content; @synced is the
+ * generation the server is known to have. The buffer is dirty while they
+ * differ, and only then do flush and fsync upload it. A buffer that was
+ * never loaded is clean.
+ *
+ * The remaining fields belong to the table of open files and must not be
+ * used directly.
+ */
+struct file_buffer {
+  std::mutex lock;
+  char* data = nullptr;
+  size_t size = 0;
+  // Allocated length of @data, which grows ahead of @size
+  size_t capacity = 0;
+  uint64_t generation = 0;
+  uint64_t synced = 0;
+
+  uint64_t ino = 0;
+  unsigned refs = 0;
+  unsigned pins = 0;
+  bool loaded = false;
+  // Place in the eviction order, while loaded
+  std::list<struct file_buffer*>::iterator lru;
+  bool loading = false;
+  std::vector<std::function<void(int err)>> waiting;
+};
+
+/**
+ * networkfs_buffer_configure - bound the memory taken by open files.
+ * @limit: Bytes of content to keep loaded before clean content is evicted.
+ */
+void networkfs_buffer_configure(size_t limit);
+
+/**
+ * networkfs_buffer_acquire - get the shared buffer of a file being opened.
+ * @ino: Inode number.
+ *
+ * The content is not loaded; see networkfs_buffer_load().
+ *
+ * Return: the buffer with a reference taken, or nullptr if out of memory.
+ */
+struct file_buffer* networkfs_buffer_acquire(uint64_t ino);
+
+/**
+ * networkfs_buffer_find - get the shared buffer of a file if it is open.
+ * @ino: Inode number.
+ *
+ * Return: the buffer, pinned, if it is loaded, or nullptr.
+ */
+struct file_buffer* networkfs_buffer_find(uint64_t ino);
+
+/**
+ * networkfs_buffer_release - drop the reference taken by acquire.
+ * @fb: Shared buffer.
+ *
+ * The buffer is freed once the last reference and pin are gone.
+ */
+void networkfs_buffer_release(struct file_buffer* fb);
+
+/**
+ * networkfs_buffer_unpin - let the content of @fb be evicted again.
+ * @fb: Shared buffer, pinned by find, load or loaded.
+ *
+ * Like a reference, a pin keeps the buffer itself alive.
+ */
+void networkfs_buffer_unpin(struct file_buffer* fb);
+
+enum networkfs_buffer_state {
+  // The content is loaded, and pinned for the caller.
+  NETWORKFS_BUFFER_LOADED,
+  // Another handler is loading it; the callback runs once it is done. The
+  // content may be evicted again before the caller asks anew.
+  NETWORKFS_BUFFER_QUEUED,
+  // Nobody has loaded it; the caller must, then call
+  // networkfs_buffer_loaded().
+  NETWORKFS_BUFFER_CLAIMED,
+};
+
+/**
+ * networkfs_buffer_load - find out whether the content of @fb is loaded.
+ * @fb:    Shared buffer.
+ * @ready: Kept only in the NETWORKFS_BUFFER_QUEUED case, and then run by
+ *         networkfs_buffer_loaded() with its @err.
+ *
+ * Return: what the caller has to do, see enum networkfs_buffer_state.
+ */
+enum networkfs_buffer_state networkfs_buffer_load(
+    struct file_buffer* fb, std::function<void(int err)> ready);
+
+/**
+ * networkfs_buffer_loaded - finish loading claimed by networkfs_buffer_load.
+ * @fb:  Shared buffer.
+ * @err: 0 if the content is now loaded, or a positive errno. After a
+ *       failure the next networkfs_buffer_load() claims loading again.
+ *
+ * Runs the callbacks queued by networkfs_buffer_load(). On success the
+ * content is pinned for the caller.
+ */
+void networkfs_buffer_loaded(struct file_buffer* fb, int err);
+
+/**
+ * networkfs_buffer_assign - replace the content of @fb.
+ * @fb:   Shared buffer; the caller holds @fb->lock.
+ * @data: New content.
+ * @size: Its length.
+ *
+ * Does not change the generation.
+ *
+ * Return: false if out of memory.
+ */
+bool networkfs_buffer_assign(struct file_buffer* fb, const char* data,
+                             size_t size);
+
+/**
+ * networkfs_buffer_resize - truncate or zero-extend the content of @fb.
+ * @fb:   Shared buffer; the caller holds @fb->lock.
+ * @size: New length.
+ *
+ * Bumps the generation if the length changes.
+ *
+ * Return: false if out of memory.
+ */
+bool networkfs_buffer_resize(struct file_buffer* fb, size_t size);
+
+/**
+ * networkfs_buffer_write - write into the content of @fb.
+ * @fb:   Shared buffer; the caller holds @fb->lock.
+ * @data: Bytes to write.
+ * @size: Their count.
+ * @off:  Offset to write at; a gap past the end is zero-filled.
+ *
+ * Bumps the generation.
+ *
+ * Return: false if out of memory.
+ */
+bool networkfs_buffer_write(struct file_buffer* fb, const char* data,
+                            size_t size, off_t off);
+
+/**
+ * networkfs_buffer_copy - write request data into the content of @fb.
+ * @fb:  Shared buffer; the caller holds @fb->lock.
+ * @src: Data to write, in memory or still in the pipe it was spliced to.
+ * @off: Offset to write at; a gap past the end is zero-filled.
+ *
+ * Like networkfs_buffer_write(), but copies with fuse_buf_copy() and so
+ * consumes @src.
+ *
+ * Return: bytes written, or a negative errno.
+ */
+ssize_t networkfs_buffer_copy(struct file_buffer* fb, struct fuse_bufvec* src,
+                              off_t off);
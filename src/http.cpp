@@ -1,7 +1,32 @@
 #include "http.h"
 
+#include <linux/io_uring.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <initializer_list>
+#include <memory>
+#include <mutex>
 #include <span>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 
 #include "subprojects/cpp-httplib/httplib.h"
 #include "util.h"
@@ -9,61 +34,1197 @@
 const char* SERVER_HOST = "nerc.itmo.ru";
 const int SERVER_PORT = 80;
 
-int64_t networkfs_http_call(
-    const char* token, const char* method, char* response_buffer,
-    size_t buffer_size,
-    std::span<const std::pair<std::string, std::string>> args) {
-  httplib::Client cli(SERVER_HOST, SERVER_PORT);
-  cli.set_keep_alive(false);
-  cli.set_connection_timeout(10);  // 10 seconds
-  cli.set_read_timeout(10);        // 10 seconds
-  cli.set_write_timeout(10);       // 10 seconds
+// Give up on a request that got no response within this time.
+const auto REQUEST_TIMEOUT = std::chrono::seconds(10);
 
+using pool_clock = std::chrono::steady_clock;
+
+static std::string api_path(const char* token, const char* method) {
   std::string path = "/teaching/os/networkfs/v1/";
   path += token;
   path += "/fs/";
   path += method;
+  return path;
+}
 
-  httplib::Params params;
+static std::string api_query(
+    std::span<const std::pair<std::string, std::string>> args) {
+  std::string query;
   for (const auto& [key, value] : args) {
-    params.emplace(key, value);
-  }
-
-  auto res = cli.Get(path.c_str(), params, httplib::Headers());
-
-  if (!res) {
-    switch (res.error()) {
-      case httplib::Error::Connection:
-        return -ESOCKNOCONNECT;
-      case httplib::Error::Read:
-        return -ESOCKNOMSGRECV;
-      case httplib::Error::Write:
-        return -ESOCKNOMSGSEND;
-      default:
-        return -EHTTPMALFORMED;
+    if (!query.empty()) {
+      query += '&';
     }
+    query += httplib::encode_query_component(key);
+    query += '=';
+    query += httplib::encode_query_component(value);
   }
+  return query;
+}
 
-  if (res->status != 200) {
-    return -EHTTPBADCODE;
-  }
-
-  if (res->body.size() < sizeof(int64_t)) {
+/*
+ * Splits a response body into the status word and the payload, copying the
+ * latter into @response_buffer.
+ */
+static int64_t response_unpack(std::string_view body, char* response_buffer,
+                               size_t buffer_size) {
+  if (body.size() < sizeof(int64_t)) {
     return -EPROTMALFORMED;
   }
 
   int64_t return_value;
-  memcpy(&return_value, res->body.data(), sizeof(int64_t));
+  memcpy(&return_value, body.data(), sizeof(int64_t));
 
-  size_t response_data_len = res->body.size() - sizeof(int64_t);
+  size_t response_data_len = body.size() - sizeof(int64_t);
   if (response_data_len > buffer_size) {
     return -ENOSPC;
   }
 
   if (response_data_len > 0) {
-    memcpy(response_buffer, res->body.data() + sizeof(int64_t),
-           response_data_len);
+    memcpy(response_buffer, body.data() + sizeof(int64_t), response_data_len);
   }
 
   return return_value;
 }
+
+// Methods that are safe to resend if the connection broke mid-request.
+static bool method_is_idempotent(const char* method) {
+  return strcmp(method, "list") == 0 || strcmp(method, "read") == 0 ||
+         strcmp(method, "lookup") == 0 || strcmp(method, "write") == 0;
+}
+
+// Methods whose concurrent identical calls can share one response.
+static bool method_is_shareable(const char* method) {
+  return strcmp(method, "list") == 0 || strcmp(method, "read") == 0 ||
+         strcmp(method, "lookup") == 0;
+}
+
+/*
+ * The inode a call is about: the directory of calls on names ("parent"),
+ * otherwise the file or directory itself ("inode"). A change made by one call
+ * can only alter the answers to calls with the same scope.
+ */
+static std::string call_scope(
+    std::span<const std::pair<std::string, std::string>> args) {
+  for (const char* key : {"parent", "inode"}) {
+    for (const auto& [name, value] : args) {
+      if (name == key) {
+        return value;
+      }
+    }
+  }
+  return "";
+}
+
+/*
+ * Event-driven transport; the blocking networkfs_http_call() is built on top.
+ *
+ * Every connection is a non-blocking keep-alive socket registered in a
+ * private epoll instance, and walks through CONNECTING -> SENDING ->
+ * RECEIVING -> IDLE for each request it carries. Requests wait in a queue
+ * until a connection is free; at most @engine.capacity connections are open
+ * at once. Idle connections stay in the epoll set, so ones closed by the
+ * server are noticed and dropped before they are reused. The epoll fd is
+ * exposed so that the caller's event loop can sleep on it.
+ *
+ * All engine state is guarded by @engine.mutex, which is never held while
+ * completion callbacks run. Threads blocked in networkfs_http_call() take
+ * turns driving the engine: one of them polls the sockets and runs the
+ * completions of everybody's calls, the others sleep on @engine.progress.
+ * An event loop that has called networkfs_http_attach() keeps the turn for
+ * good, so the completions all run on its thread.
+ *
+ * Optionally the socket I/O goes through an io_uring instead (see uring_setup()
+ * below); the state machine stays the same.
+ *
+ * Identical read-only calls in flight at the same time are sent once: a call
+ * that finds its request text (method and arguments) in @engine.shared joins
+ * that request, and all of them complete from the one response. Any other
+ * call may change what the server would answer for its scope (see
+ * call_scope()), so the requests of that scope leave the table when it
+ * starts and again when it finishes; a read-only call never joins a request
+ * that could have been answered before a change it must observe.
+ */
+
+// A caller waiting for a request, and the payload size it accepts.
+struct http_waiter {
+  size_t buffer_size;
+  networkfs_http_callback done;
+};
+
+struct http_request {
+  std::string text;  // serialized GET request
+  std::string scope;
+  size_t buffer_size;  // largest of @waiters
+  bool idempotent;
+  bool shareable;
+  bool retried = false;
+  // While queued, until when it may wait for a connection; once sent,
+  // until when it may wait for the response.
+  pool_clock::time_point deadline;
+  // The caller, then identical calls that joined it.
+  std::vector<http_waiter> waiters;
+};
+
+enum http_state { HTTP_IDLE, HTTP_CONNECTING, HTTP_SENDING, HTTP_RECEIVING };
+
+struct http_connection {
+  int fd = -1;
+  http_state state = HTTP_CONNECTING;
+  bool reused = false;  // has completed at least one request
+  std::unique_ptr<http_request> request;
+  size_t sent = 0;
+  std::string in;
+  pool_clock::time_point last_used;
+  // io_uring only: ring operations not completed yet, and the memory they
+  // read from, which must outlive the request in case it is failed early.
+  unsigned inflight = 0;
+  bool receiving = false;
+  std::string out;
+  struct sockaddr_storage addr;
+};
+
+struct http_completion {
+  std::unique_ptr<http_request> request;
+  int64_t result;
+  std::string body;
+};
+
+static struct {
+  std::mutex mutex;
+  std::condition_variable progress;
+  bool driving = false;
+  std::thread::id driver;
+  // Completed runs of networkfs_http_process().
+  uint64_t rounds = 0;
+  size_t capacity = 4;
+  pool_clock::duration idle_timeout = std::chrono::seconds(15);
+  bool uring = false;
+  std::vector<std::unique_ptr<http_connection>> connections;
+  // Closed, but still referenced by ring operations.
+  std::vector<std::unique_ptr<http_connection>> closing;
+  std::deque<std::unique_ptr<http_request>> queue;
+  // Shareable requests in flight, by request text.
+  std::unordered_map<std::string_view, http_request*> shared;
+  std::vector<http_completion> completed;
+  struct sockaddr_storage addr;
+  socklen_t addr_len = 0;
+} engine;
+
+/*
+ * io_uring socket I/O, driven with raw system calls.
+ *
+ * One ring carries the connect, send and recv operations of all connections.
+ * Each connection keeps a single multishot recv armed for its whole life,
+ * which takes buffers from a ring of provided buffers, so reading a response
+ * costs no system call at all and sends are batched into one io_uring_enter()
+ * per engine_pump(). The ring fd sits in the epoll set in place of the
+ * sockets, so networkfs_http_fd() keeps its meaning.
+ *
+ * Operations point at their connection through user_data. A closed
+ * connection is shut down, which completes its pending operations, and is
+ * only freed once their last completion has been seen.
+ */
+
+#define URING_ENTRIES 256
+#define URING_BUF_COUNT 128  // power of two
+#define URING_BUF_SIZE 4096
+#define URING_BGID 0
+
+// URING_CANCEL aborts the other operations of a connection being closed.
+enum uring_op { URING_CANCEL, URING_CONNECT, URING_SEND, URING_RECV };
+
+static struct {
+  int fd = -1;
+  unsigned sq_entries;
+  unsigned sq_mask;
+  unsigned* sq_head;
+  unsigned* sq_tail;
+  unsigned* sq_flags;
+  struct io_uring_sqe* sqes = nullptr;
+  unsigned cq_mask;
+  unsigned* cq_head;
+  unsigned* cq_tail;
+  struct io_uring_cqe* cqes;
+  // Not buf_ring->bufs: in C++ the empty struct the kernel header puts in
+  // front of that flexible array takes up space and shifts it.
+  struct io_uring_buf* bufs = nullptr;
+  uint16_t* buf_ring_tail;
+  uint16_t buf_tail = 0;
+  char* buffers;
+  // Mappings, for uring_teardown()
+  void* ring = MAP_FAILED;
+  size_t ring_size;
+  size_t sqes_size;
+  size_t bufs_size;
+} uring;
+
+static int uring_enter(unsigned to_submit, unsigned min_complete,
+                       unsigned flags) {
+  return syscall(__NR_io_uring_enter, uring.fd, to_submit, min_complete, flags,
+                 nullptr, 0);
+}
+
+static int uring_register(unsigned opcode, void* arg, unsigned nr_args) {
+  return syscall(__NR_io_uring_register, uring.fd, opcode, arg, nr_args);
+}
+
+// Hands buffer @bid back to the kernel for further receives.
+static void uring_recycle(unsigned bid) {
+  unsigned index = uring.buf_tail & (URING_BUF_COUNT - 1);
+  struct io_uring_buf* buf = &uring.bufs[index];
+  buf->addr = (uintptr_t)(uring.buffers + (size_t)bid * URING_BUF_SIZE);
+  buf->len = URING_BUF_SIZE;
+  buf->bid = bid;
+  uring.buf_tail++;
+  std::atomic_ref<uint16_t>(*uring.buf_ring_tail)
+      .store(uring.buf_tail, std::memory_order_release);
+}
+
+// Submits every queued operation.
+static void uring_submit() {
+  unsigned tail = *uring.sq_tail;
+  unsigned head =
+      std::atomic_ref<unsigned>(*uring.sq_head).load(std::memory_order_acquire);
+  if (tail != head) {
+    uring_enter(tail - head, 0, 0);
+  }
+}
+
+static struct io_uring_sqe* uring_sqe(http_connection* conn, uring_op op) {
+  unsigned tail = *uring.sq_tail;
+  unsigned head =
+      std::atomic_ref<unsigned>(*uring.sq_head).load(std::memory_order_acquire);
+  if (tail - head == uring.sq_entries) {
+    // The kernel consumes the whole queue synchronously.
+    uring_submit();
+  }
+  struct io_uring_sqe* sqe = &uring.sqes[tail & uring.sq_mask];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->user_data = (uintptr_t)conn | op;
+  std::atomic_ref<unsigned>(*uring.sq_tail)
+      .store(tail + 1, std::memory_order_release);
+  conn->inflight++;
+  return sqe;
+}
+
+static bool uring_supported(const struct io_uring_probe* probe,
+                            std::initializer_list<int> ops) {
+  return std::all_of(ops.begin(), ops.end(), [probe](int op) {
+    return op < probe->ops_len &&
+           (probe->ops[op].flags & IO_URING_OP_SUPPORTED);
+  });
+}
+
+/*
+ * Multishot recv has no opcode of its own, so it is tried out: on a socket
+ * whose peer has shut down it completes right away, with -EINVAL if the
+ * kernel does not know the flag. Returns 0 or a negated errno.
+ */
+static int uring_probe_recv_multishot() {
+  int sv[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) != 0) {
+    return -errno;
+  }
+  shutdown(sv[1], SHUT_WR);
+
+  unsigned tail = *uring.sq_tail;
+  struct io_uring_sqe* sqe = &uring.sqes[tail & uring.sq_mask];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = sv[0];
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = URING_BGID;
+  std::atomic_ref<unsigned>(*uring.sq_tail)
+      .store(tail + 1, std::memory_order_release);
+
+  int res = uring_enter(1, 1, IORING_ENTER_GETEVENTS) < 0 ? -errno : 0;
+  if (res == 0) {
+    unsigned head = *uring.cq_head;
+    struct io_uring_cqe* cqe = &uring.cqes[head & uring.cq_mask];
+    res = std::min(cqe->res, 0);
+    if (cqe->flags & IORING_CQE_F_BUFFER) {
+      uring_recycle(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+    }
+    std::atomic_ref<unsigned>(*uring.cq_head)
+        .store(head + 1, std::memory_order_release);
+  }
+  close(sv[0]);
+  close(sv[1]);
+  return res;
+}
+
+// Unmaps and closes whatever uring_create() got to set up.
+static void uring_teardown() {
+  if (uring.ring != MAP_FAILED) {
+    munmap(uring.ring, uring.ring_size);
+    uring.ring = MAP_FAILED;
+  }
+  if (uring.sqes != nullptr) {
+    munmap(uring.sqes, uring.sqes_size);
+    uring.sqes = nullptr;
+  }
+  if (uring.bufs != nullptr) {
+    munmap(uring.bufs, uring.bufs_size);
+    uring.bufs = nullptr;
+  }
+  if (uring.fd >= 0) {
+    close(uring.fd);
+    uring.fd = -1;
+  }
+}
+
+static int uring_create(int epoll_fd) {
+  struct io_uring_params p = {};
+  p.flags = IORING_SETUP_CLAMP;
+  uring.fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+  if (uring.fd < 0) {
+    return -errno;
+  }
+  if (!(p.features & IORING_FEAT_SINGLE_MMAP) ||
+      !(p.features & IORING_FEAT_NODROP)) {
+    return -ENOSYS;
+  }
+
+  std::vector<char> probe_mem(sizeof(struct io_uring_probe) +
+                              256 * sizeof(struct io_uring_probe_op));
+  auto* probe = (struct io_uring_probe*)probe_mem.data();
+  if (uring_register(IORING_REGISTER_PROBE, probe, 256) < 0) {
+    return -errno;
+  }
+  if (!uring_supported(probe,
+                       {IORING_OP_CONNECT, IORING_OP_SEND, IORING_OP_RECV,
+                        IORING_OP_ASYNC_CANCEL})) {
+    return -ENOSYS;
+  }
+
+  uring.ring_size =
+      std::max(p.sq_off.array + p.sq_entries * sizeof(unsigned),
+               p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe));
+  uring.ring = mmap(nullptr, uring.ring_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, uring.fd, IORING_OFF_SQ_RING);
+  if (uring.ring == MAP_FAILED) {
+    return -errno;
+  }
+  uring.sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+  void* sqes = mmap(nullptr, uring.sqes_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, uring.fd, IORING_OFF_SQES);
+  if (sqes == MAP_FAILED) {
+    return -errno;
+  }
+  char* base = (char*)uring.ring;
+  uring.sq_entries = p.sq_entries;
+  uring.sq_mask = *(unsigned*)(base + p.sq_off.ring_mask);
+  uring.sq_head = (unsigned*)(base + p.sq_off.head);
+  uring.sq_tail = (unsigned*)(base + p.sq_off.tail);
+  uring.sq_flags = (unsigned*)(base + p.sq_off.flags);
+  uring.sqes = (struct io_uring_sqe*)sqes;
+  uring.cq_mask = *(unsigned*)(base + p.cq_off.ring_mask);
+  uring.cq_head = (unsigned*)(base + p.cq_off.head);
+  uring.cq_tail = (unsigned*)(base + p.cq_off.tail);
+  uring.cqes = (struct io_uring_cqe*)(base + p.cq_off.cqes);
+  // SQ slots map one to one onto SQEs.
+  auto* array = (unsigned*)(base + p.sq_off.array);
+  for (unsigned i = 0; i < p.sq_entries; i++) {
+    array[i] = i;
+  }
+
+  // Shared, so that the pages the kernel pins stay ours.
+  size_t ring_entries_size = URING_BUF_COUNT * sizeof(struct io_uring_buf);
+  uring.bufs_size = ring_entries_size + URING_BUF_COUNT * URING_BUF_SIZE;
+  void* bufs = mmap(nullptr, uring.bufs_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (bufs == MAP_FAILED) {
+    return -errno;
+  }
+  uring.bufs = (struct io_uring_buf*)bufs;
+  uring.buf_ring_tail = &((struct io_uring_buf_ring*)bufs)->tail;
+  uring.buffers = (char*)bufs + ring_entries_size;
+  struct io_uring_buf_reg reg = {};
+  reg.ring_addr = (uintptr_t)bufs;
+  reg.ring_entries = URING_BUF_COUNT;
+  reg.bgid = URING_BGID;
+  if (uring_register(IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+    return -errno;
+  }
+  for (unsigned bid = 0; bid < URING_BUF_COUNT; bid++) {
+    uring_recycle(bid);
+  }
+
+  int err = uring_probe_recv_multishot();
+  if (err != 0) {
+    return err;
+  }
+
+  struct epoll_event ev = {};
+  ev.events = EPOLLIN;
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, uring.fd, &ev) != 0) {
+    return -errno;
+  }
+  return 0;
+}
+
+/*
+ * Sets up the ring and adds it to @epoll_fd. Returns 0 or a negated errno,
+ * leaving the engine on epoll.
+ */
+static int uring_setup(int epoll_fd) {
+  int err = uring_create(epoll_fd);
+  if (err != 0) {
+    uring_teardown();
+  }
+  return err;
+}
+
+// Picks the transport. Runs on first use, i.e. after fuse_daemonize() forks.
+static int engine_open() {
+  int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (engine.uring) {
+    int err = uring_setup(epoll_fd);
+    if (err != 0) {
+      fprintf(stderr, "networkfs: no io_uring socket I/O (%s), using epoll\n",
+              strerror(-err));
+    }
+  }
+  return epoll_fd;
+}
+
+void networkfs_http_configure(size_t pool_size, unsigned idle_timeout,
+                              bool io_uring) {
+  std::lock_guard<std::mutex> lock(engine.mutex);
+  engine.capacity = pool_size > 0 ? pool_size : 1;
+  engine.idle_timeout = std::chrono::seconds(idle_timeout);
+  engine.uring = io_uring;
+}
+
+int networkfs_http_fd() {
+  static const int epoll_fd = engine_open();
+  return epoll_fd;
+}
+
+/*
+ * Takes the shareable requests that a change to @scope may make stale out of
+ * @engine.shared; all of them for an unknown scope.
+ */
+static void engine_unshare(const std::string& scope) {
+  if (scope.empty()) {
+    engine.shared.clear();
+    return;
+  }
+  std::erase_if(engine.shared, [&scope](const auto& item) {
+    return item.second->scope == scope;
+  });
+}
+
+static void engine_complete(std::unique_ptr<http_request> request,
+                            int64_t result, std::string body = {}) {
+  if (!request->shareable) {
+    engine_unshare(request->scope);
+  } else if (auto it = engine.shared.find(request->text);
+             it != engine.shared.end() && it->second == request.get()) {
+    engine.shared.erase(it);
+  }
+  engine.completed.push_back({std::move(request), result, std::move(body)});
+}
+
+static void engine_watch(http_connection* conn, bool writable) {
+  struct epoll_event ev = {};
+  ev.events = EPOLLIN | EPOLLRDHUP;
+  if (writable) {
+    ev.events |= EPOLLOUT;
+  }
+  ev.data.ptr = conn;
+  epoll_ctl(networkfs_http_fd(), EPOLL_CTL_MOD, conn->fd, &ev);
+}
+
+static void engine_close(http_connection* conn) {
+  if (uring.fd >= 0 && conn->inflight > 0) {
+    // The ring holds its own reference to the socket, so closing it does
+    // not end the operations still pending on it; neither does shutdown()
+    // end a connect. Cancel them instead.
+    for (uring_op op : {URING_CONNECT, URING_SEND, URING_RECV}) {
+      struct io_uring_sqe* sqe = uring_sqe(conn, URING_CANCEL);
+      sqe->opcode = IORING_OP_ASYNC_CANCEL;
+      sqe->addr = (uintptr_t)conn | op;
+      sqe->cancel_flags = IORING_ASYNC_CANCEL_ALL;
+    }
+    uring_submit();
+  }
+  close(conn->fd);
+  auto it = std::find_if(engine.connections.begin(), engine.connections.end(),
+                         [conn](const auto& c) { return c.get() == conn; });
+  if (conn->inflight > 0) {
+    engine.closing.push_back(std::move(*it));
+  }
+  engine.connections.erase(it);
+}
+
+/*
+ * Drops a broken connection. Its request is put back in front of the queue if
+ * the server cannot have acted on it yet (or acting twice is harmless), and
+ * completed with @err otherwise.
+ */
+static void engine_fail(http_connection* conn, int64_t err) {
+  std::unique_ptr<http_request> request = std::move(conn->request);
+  bool unanswered = conn->in.empty();
+  bool retry = request && conn->reused && !request->retried && unanswered &&
+               (conn->state != HTTP_RECEIVING || request->idempotent);
+  engine_close(conn);
+
+  if (!request) {
+    return;
+  }
+  if (retry) {
+    request->retried = true;
+    engine.queue.push_front(std::move(request));
+  } else {
+    engine_complete(std::move(request), err);
+  }
+}
+
+static bool engine_resolve() {
+  if (engine.addr_len > 0) {
+    return true;
+  }
+
+  struct addrinfo hints = {};
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  struct addrinfo* res;
+  std::string port = std::to_string(SERVER_PORT);
+  if (getaddrinfo(SERVER_HOST, port.c_str(), &hints, &res) != 0) {
+    return false;
+  }
+  memcpy(&engine.addr, res->ai_addr, res->ai_addrlen);
+  engine.addr_len = res->ai_addrlen;
+  freeaddrinfo(res);
+  return true;
+}
+
+static http_connection* engine_connect() {
+  int epoll_fd = networkfs_http_fd();
+  if (!engine_resolve()) {
+    return nullptr;
+  }
+
+  // The ring waits for sockets by itself, and only if they block.
+  int type = SOCK_STREAM | SOCK_CLOEXEC | (uring.fd < 0 ? SOCK_NONBLOCK : 0);
+  int fd = socket(engine.addr.ss_family, type, 0);
+  if (fd < 0) {
+    return nullptr;
+  }
+  int one = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+  auto conn = std::make_unique<http_connection>();
+  conn->fd = fd;
+  if (uring.fd >= 0) {
+    conn->addr = engine.addr;
+    struct io_uring_sqe* sqe = uring_sqe(conn.get(), URING_CONNECT);
+    sqe->opcode = IORING_OP_CONNECT;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t)&conn->addr;
+    sqe->off = engine.addr_len;
+  } else {
+    if (connect(fd, (struct sockaddr*)&engine.addr, engine.addr_len) != 0 &&
+        errno != EINPROGRESS) {
+      close(fd);
+      // The address may be outdated, look it up again next time.
+      engine.addr_len = 0;
+      return nullptr;
+    }
+    struct epoll_event ev = {};
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP;
+    ev.data.ptr = conn.get();
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+  }
+
+  engine.connections.push_back(std::move(conn));
+  return engine.connections.back().get();
+}
+
+static void uring_send(http_connection* conn) {
+  if (conn->sent == 0) {
+    conn->out = conn->request->text;
+  }
+  struct io_uring_sqe* sqe = uring_sqe(conn, URING_SEND);
+  sqe->opcode = IORING_OP_SEND;
+  sqe->fd = conn->fd;
+  sqe->addr = (uintptr_t)(conn->out.data() + conn->sent);
+  sqe->len = conn->out.size() - conn->sent;
+  sqe->msg_flags = MSG_NOSIGNAL;
+}
+
+static void uring_receive(http_connection* conn) {
+  struct io_uring_sqe* sqe = uring_sqe(conn, URING_RECV);
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = conn->fd;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = URING_BGID;
+  conn->receiving = true;
+}
+
+static void engine_send(http_connection* conn) {
+  if (uring.fd >= 0) {
+    uring_send(conn);
+    return;
+  }
+  const std::string& text = conn->request->text;
+  while (conn->sent < text.size()) {
+    ssize_t n = send(conn->fd, text.data() + conn->sent,
+                     text.size() - conn->sent, MSG_NOSIGNAL);
+    if (n >= 0) {
+      conn->sent += n;
+    } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      engine_watch(conn, true);
+      return;
+    } else if (errno != EINTR) {
+      engine_fail(conn, -ESOCKNOMSGSEND);
+      return;
+    }
+  }
+  conn->state = HTTP_RECEIVING;
+  engine_watch(conn, false);
+}
+
+// Returns an idle connection, closing the ones that have been idle too long.
+static http_connection* engine_idle_connection() {
+  auto now = pool_clock::now();
+  http_connection* found = nullptr;
+  for (size_t i = 0; i < engine.connections.size(); i++) {
+    http_connection* conn = engine.connections[i].get();
+    if (conn->state != HTTP_IDLE) {
+      continue;
+    }
+    if (now - conn->last_used > engine.idle_timeout) {
+      engine_close(conn);
+      i--;
+    } else if (!found) {
+      found = conn;
+    }
+  }
+  return found;
+}
+
+// Hands queued requests to idle connections, opening new ones if allowed.
+static void engine_pump() {
+  while (!engine.queue.empty()) {
+    http_connection* conn = engine_idle_connection();
+    if (!conn && engine.connections.size() < engine.capacity) {
+      conn = engine_connect();
+      if (!conn) {
+        engine_complete(std::move(engine.queue.front()), -ESOCKNOCONNECT);
+        engine.queue.pop_front();
+        continue;
+      }
+    }
+    if (!conn) {
+      return;
+    }
+
+    conn->request = std::move(engine.queue.front());
+    engine.queue.pop_front();
+    // Time spent in the queue does not count against the response.
+    conn->request->deadline = pool_clock::now() + REQUEST_TIMEOUT;
+    conn->sent = 0;
+    conn->in.clear();
+    if (conn->state == HTTP_IDLE) {
+      conn->state = HTTP_SENDING;
+      engine_send(conn);
+    }
+  }
+  if (uring.fd >= 0) {
+    uring_submit();
+  }
+}
+
+static bool header_equals(std::string_view line, std::string_view name,
+                          std::string_view* value) {
+  if (line.size() <= name.size() || line[name.size()] != ':' ||
+      strncasecmp(line.data(), name.data(), name.size()) != 0) {
+    return false;
+  }
+  *value = line.substr(name.size() + 1);
+  while (!value->empty() && (value->front() == ' ' || value->front() == '\t')) {
+    value->remove_prefix(1);
+  }
+  return true;
+}
+
+/*
+ * Decodes a chunked body starting at @pos. Returns the number of bytes
+ * consumed, 0 if more data is needed, or -1 if the encoding is malformed.
+ */
+static ssize_t parse_chunked(std::string_view in, size_t pos,
+                             std::string* body) {
+  body->clear();
+  for (;;) {
+    size_t eol = in.find("\r\n", pos);
+    if (eol == std::string_view::npos) {
+      return 0;
+    }
+    char* end;
+    std::string size_line(in.substr(pos, eol - pos));
+    unsigned long size = strtoul(size_line.c_str(), &end, 16);
+    if (end == size_line.c_str()) {
+      return -1;
+    }
+    pos = eol + 2;
+    if (size == 0) {
+      // Skip trailers up to the terminating empty line.
+      size_t last = in.find("\r\n\r\n", pos - 2);
+      return last == std::string_view::npos ? 0 : last + 4;
+    }
+    if (in.size() < pos + size + 2) {
+      return 0;
+    }
+    body->append(in.substr(pos, size));
+    pos += size + 2;
+  }
+}
+
+/*
+ * Parses a response accumulated in @conn->in. Returns 1 when a full response
+ * has been read, 0 if more data is needed and -1 on malformed input.
+ * @eof means the server has closed the connection.
+ */
+static int parse_response(http_connection* conn, bool eof, int* status,
+                          std::string* body, bool* keep_alive) {
+  std::string_view in = conn->in;
+  size_t header_end = in.find("\r\n\r\n");
+  if (header_end == std::string_view::npos) {
+    return eof ? -1 : 0;
+  }
+
+  std::string_view head = in.substr(0, header_end + 2);
+  size_t eol = head.find("\r\n");
+  std::string_view status_line = head.substr(0, eol);
+  if (status_line.size() < 12 || !status_line.starts_with("HTTP/1.")) {
+    return -1;
+  }
+  *status = atoi(std::string(status_line.substr(9, 3)).c_str());
+  *keep_alive = status_line[7] == '1';
+
+  bool chunked = false;
+  long content_length = -1;
+  for (size_t pos = eol + 2; pos < head.size();) {
+    size_t next = head.find("\r\n", pos);
+    std::string_view line = head.substr(pos, next - pos), value;
+    if (header_equals(line, "Content-Length", &value)) {
+      content_length = atol(std::string(value).c_str());
+    } else if (header_equals(line, "Transfer-Encoding", &value)) {
+      chunked = value.find("chunked") != std::string_view::npos;
+    } else if (header_equals(line, "Connection", &value)) {
+      if (strncasecmp(value.data(), "close", 5) == 0) {
+        *keep_alive = false;
+      } else if (strncasecmp(value.data(), "keep-alive", 10) == 0) {
+        *keep_alive = true;
+      }
+    }
+    pos = next + 2;
+  }
+
+  size_t body_start = header_end + 4;
+  if (chunked) {
+    ssize_t used = parse_chunked(in, body_start, body);
+    if (used <= 0) {
+      return used < 0 || eof ? -1 : 0;
+    }
+    return 1;
+  }
+  if (content_length >= 0) {
+    if (in.size() < body_start + content_length) {
+      return eof ? -1 : 0;
+    }
+    body->assign(in.substr(body_start, content_length));
+    return 1;
+  }
+  // Body is delimited by the end of the connection.
+  if (!eof) {
+    return 0;
+  }
+  body->assign(in.substr(body_start));
+  *keep_alive = false;
+  return 1;
+}
+
+/*
+ * Acts on data appended to @conn->in: completes the request once its whole
+ * response is there. @eof means the server has closed the connection.
+ */
+static void engine_received(http_connection* conn, bool eof) {
+  if (conn->state != HTTP_RECEIVING) {
+    // Idle keep-alive socket closed (or poked) by the server.
+    if (eof || !conn->in.empty()) {
+      engine_fail(conn, -ESOCKNOMSGRECV);
+    }
+    return;
+  }
+
+  int status;
+  bool keep_alive;
+  std::string body;
+  int parsed = parse_response(conn, eof, &status, &body, &keep_alive);
+  if (parsed == 0) {
+    return;
+  }
+  if (parsed < 0) {
+    engine_fail(conn, eof && conn->in.empty() ? -ESOCKNOMSGRECV
+                                              : -EHTTPMALFORMED);
+    return;
+  }
+
+  std::unique_ptr<http_request> request = std::move(conn->request);
+  int64_t result = status == 200 ? 0 : -EHTTPBADCODE;
+  if (keep_alive && !eof) {
+    conn->state = HTTP_IDLE;
+    conn->reused = true;
+    conn->in.clear();
+    conn->last_used = pool_clock::now();
+  } else {
+    engine_close(conn);
+  }
+  engine_complete(std::move(request), result, std::move(body));
+}
+
+static void engine_receive(http_connection* conn) {
+  bool eof = false;
+  char buf[4096];
+  for (;;) {
+    ssize_t n = recv(conn->fd, buf, sizeof(buf), 0);
+    if (n > 0) {
+      conn->in.append(buf, n);
+      continue;
+    }
+    if (n == 0) {
+      eof = true;
+      break;
+    }
+    if (errno == EINTR) {
+      continue;
+    }
+    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      break;
+    }
+    engine_fail(conn, -ESOCKNOMSGRECV);
+    return;
+  }
+  engine_received(conn, eof);
+}
+
+static void engine_handle(http_connection* conn, uint32_t events) {
+  if (conn->state == HTTP_CONNECTING) {
+    if (!(events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) {
+      return;
+    }
+    int err = 0;
+    socklen_t len = sizeof(err);
+    getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+    if (err != 0) {
+      engine.addr_len = 0;
+      engine_fail(conn, -ESOCKNOCONNECT);
+      return;
+    }
+    conn->state = conn->request ? HTTP_SENDING : HTTP_IDLE;
+    conn->last_used = pool_clock::now();
+    if (conn->state == HTTP_IDLE) {
+      engine_watch(conn, false);
+      return;
+    }
+  }
+
+  if (conn->state == HTTP_SENDING) {
+    if (events & (EPOLLOUT | EPOLLERR | EPOLLHUP)) {
+      engine_send(conn);
+    }
+    return;
+  }
+
+  if (events & (EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLHUP)) {
+    engine_receive(conn);
+  }
+}
+
+static void uring_complete(http_connection* conn, uring_op op,
+                           const struct io_uring_cqe* cqe) {
+  if (op == URING_CONNECT) {
+    if (cqe->res < 0) {
+      engine.addr_len = 0;
+      engine_fail(conn, -ESOCKNOCONNECT);
+      return;
+    }
+    uring_receive(conn);
+    conn->state = conn->request ? HTTP_SENDING : HTTP_IDLE;
+    conn->last_used = pool_clock::now();
+    if (conn->state == HTTP_SENDING) {
+      uring_send(conn);
+    }
+    return;
+  }
+
+  if (op == URING_SEND) {
+    if (cqe->res < 0) {
+      engine_fail(conn, -ESOCKNOMSGSEND);
+      return;
+    }
+    conn->sent += cqe->res;
+    if (conn->sent < conn->out.size()) {
+      uring_send(conn);
+      return;
+    }
+    conn->state = HTTP_RECEIVING;
+    // The response may have overtaken the send completion.
+    if (!conn->in.empty()) {
+      engine_received(conn, false);
+    }
+    return;
+  }
+
+  if (cqe->res == -ENOBUFS) {
+    // Out of buffers until this batch of completions is handled.
+  } else if (cqe->res < 0) {
+    engine_fail(conn, -ESOCKNOMSGRECV);
+    return;
+  } else if (conn->state != HTTP_SENDING || cqe->res == 0) {
+    engine_received(conn, cqe->res == 0);
+    if (cqe->res == 0) {
+      return;
+    }
+  }
+  // Unless the response made it close, keep listening.
+  bool alive = std::any_of(engine.connections.begin(), engine.connections.end(),
+                           [conn](const auto& c) { return c.get() == conn; });
+  if (alive && !conn->receiving) {
+    uring_receive(conn);
+  }
+}
+
+// Handles all completions posted so far.
+static void uring_reap() {
+  if (std::atomic_ref<unsigned>(*uring.sq_flags).load(
+          std::memory_order_relaxed) &
+      IORING_SQ_CQ_OVERFLOW) {
+    uring_enter(0, 0, IORING_ENTER_GETEVENTS);
+  }
+
+  unsigned head = *uring.cq_head;
+  while (head != std::atomic_ref<unsigned>(*uring.cq_tail)
+                     .load(std::memory_order_acquire)) {
+    struct io_uring_cqe cqe = uring.cqes[head & uring.cq_mask];
+    head++;
+    std::atomic_ref<unsigned>(*uring.cq_head)
+        .store(head, std::memory_order_release);
+
+    auto* conn = (http_connection*)(cqe.user_data & ~(uintptr_t)3);
+    auto op = (uring_op)(cqe.user_data & 3);
+    bool last = !(cqe.flags & IORING_CQE_F_MORE);
+    if (last) {
+      conn->inflight--;
+      if (op == URING_RECV) {
+        conn->receiving = false;
+      }
+    }
+    if (cqe.flags & IORING_CQE_F_BUFFER) {
+      unsigned bid = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+      if (cqe.res > 0) {
+        conn->in.append(uring.buffers + (size_t)bid * URING_BUF_SIZE, cqe.res);
+      }
+      uring_recycle(bid);
+    }
+
+    auto closing = std::find_if(
+        engine.closing.begin(), engine.closing.end(),
+        [conn](const auto& c) { return c.get() == conn; });
+    if (closing == engine.closing.end()) {
+      uring_complete(conn, op, &cqe);
+    } else if (conn->inflight == 0) {
+      engine.closing.erase(closing);
+    }
+  }
+}
+
+/*
+ * Fails requests that have been waiting for longer than REQUEST_TIMEOUT,
+ * either for a connection or, once sent, for their response.
+ */
+static void engine_expire() {
+  auto now = pool_clock::now();
+  for (auto it = engine.queue.begin(); it != engine.queue.end();) {
+    if (now > (*it)->deadline) {
+      // Never sent, so failing it cannot lose a change.
+      engine_complete(std::move(*it), -ESOCKNOCONNECT);
+      it = engine.queue.erase(it);
+    } else {
+      it++;
+    }
+  }
+  for (size_t i = 0; i < engine.connections.size(); i++) {
+    http_connection* conn = engine.connections[i].get();
+    if (conn->request && now > conn->request->deadline) {
+      conn->request->retried = true;
+      engine_fail(conn, conn->state == HTTP_CONNECTING ? -ESOCKNOCONNECT
+                                                       : -ESOCKNOMSGRECV);
+      i--;
+    }
+  }
+}
+
+// Runs finished callbacks with @lock (on @engine.mutex) temporarily released.
+static void engine_run_completions(std::unique_lock<std::mutex>& lock) {
+  while (!engine.completed.empty()) {
+    std::vector<http_completion> completed;
+    completed.swap(engine.completed);
+    lock.unlock();
+    for (auto& c : completed) {
+      std::vector<char> response(c.request->buffer_size + 1, 0);
+      int64_t result = c.result;
+      if (result == 0) {
+        result = response_unpack(c.body, response.data(),
+                                 c.request->buffer_size);
+      }
+      size_t length = result >= 0 ? c.body.size() - sizeof(int64_t) : 0;
+      for (auto& waiter : c.request->waiters) {
+        // Joined calls may accept less than the request asked for
+        waiter.done(length > waiter.buffer_size ? -ENOSPC : result,
+                    response.data());
+      }
+    }
+    lock.lock();
+    // Callbacks may have queued new requests.
+    engine_pump();
+  }
+}
+
+void networkfs_http_call_async(
+    const char* token, const char* method, size_t buffer_size,
+    std::span<const std::pair<std::string, std::string>> args,
+    networkfs_http_callback done) {
+  auto request = std::make_unique<http_request>();
+  request->text = "GET " + api_path(token, method) + "?" + api_query(args) +
+                  " HTTP/1.1\r\nHost: " + SERVER_HOST +
+                  "\r\nConnection: keep-alive\r\n\r\n";
+  request->scope = call_scope(args);
+  request->buffer_size = buffer_size;
+  request->idempotent = method_is_idempotent(method);
+  request->shareable = method_is_shareable(method);
+  request->deadline = pool_clock::now() + REQUEST_TIMEOUT;
+  request->waiters.push_back({buffer_size, std::move(done)});
+
+  std::unique_lock<std::mutex> lock(engine.mutex);
+  if (!request->shareable) {
+    engine_unshare(request->scope);
+  } else {
+    auto [it, inserted] =
+        engine.shared.try_emplace(request->text, request.get());
+    if (!inserted) {
+      http_request* pending = it->second;
+      pending->buffer_size = std::max(pending->buffer_size, buffer_size);
+      pending->waiters.push_back(std::move(request->waiters.front()));
+      return;
+    }
+  }
+  engine.queue.push_back(std::move(request));
+  engine_pump();
+  // Connection failures are detected synchronously; report them right away
+  // rather than on the next wakeup.
+  engine_run_completions(lock);
+}
+
+void networkfs_http_process() {
+  int epoll_fd = networkfs_http_fd();
+  std::unique_lock<std::mutex> lock(engine.mutex);
+  struct epoll_event events[64];
+  // The ring fd needs no draining, its completions are all in memory.
+  int n = uring.fd >= 0 ? 0 : epoll_wait(epoll_fd, events, 64, 0);
+  if (uring.fd >= 0) {
+    uring_reap();
+  }
+  for (int i = 0; i < n; i++) {
+    auto* conn = (http_connection*)events[i].data.ptr;
+    // An earlier event in this batch may have closed the connection.
+    bool alive = std::any_of(
+        engine.connections.begin(), engine.connections.end(),
+        [conn](const auto& c) { return c.get() == conn; });
+    if (alive) {
+      engine_handle(conn, events[i].events);
+    }
+  }
+  engine_expire();
+  engine_pump();
+  engine_run_completions(lock);
+  engine.rounds++;
+  engine.progress.notify_all();
+}
+
+/*
+ * Waits for engine progress, driving it unless another thread already does.
+ * Returns early once @finished (if given) is set.
+ */
+static void engine_wait(const std::atomic<bool>* finished) {
+  std::unique_lock<std::mutex> lock(engine.mutex);
+  auto done = [finished] { return finished && finished->load(); };
+  if (done()) {
+    return;
+  }
+  if (engine.driving && engine.driver != std::this_thread::get_id()) {
+    uint64_t rounds = engine.rounds;
+    engine.progress.wait(lock, [&] {
+      return !engine.driving || engine.rounds != rounds || done();
+    });
+    return;
+  }
+
+  // A completion callback of ours may make a blocking call itself.
+  bool nested = engine.driving;
+  engine.driving = true;
+  engine.driver = std::this_thread::get_id();
+  lock.unlock();
+
+  struct pollfd pfd = {networkfs_http_fd(), POLLIN, 0};
+  // Wake up at least once a second to expire stuck requests.
+  poll(&pfd, 1, 1000);
+  networkfs_http_process();
+
+  lock.lock();
+  engine.driving = nested;
+  engine.progress.notify_all();
+}
+
+void networkfs_http_wait() { engine_wait(nullptr); }
+
+void networkfs_http_attach() {
+  std::unique_lock<std::mutex> lock(engine.mutex);
+  // Let a blocked call finish its turn first.
+  engine.progress.wait(lock, [] { return !engine.driving; });
+  engine.driving = true;
+  engine.driver = std::this_thread::get_id();
+}
+
+void networkfs_http_detach() {
+  std::lock_guard<std::mutex> lock(engine.mutex);
+  engine.driving = false;
+  engine.progress.notify_all();
+}
+
+int64_t networkfs_http_call(
+    const char* token, const char* method, char* response_buffer,
+    size_t buffer_size,
+    std::span<const std::pair<std::string, std::string>> args) {
+  std::atomic<bool> finished = false;
+  int64_t ret;
+  networkfs_http_call_async(
+      token, method, buffer_size, args,
+      [&](int64_t result, const char* response) {
+        if (result >= 0) {
+          memcpy(response_buffer, response, buffer_size);
+        }
+        ret = result;
+        finished = true;
+      });
+
+  while (!finished) {
+    engine_wait(&finished);
+  }
+  return ret;
+}
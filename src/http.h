@@ -2,10 +2,27 @@
 #define NETWORKFS_HTTP
 
 #include <cstdint>
+#include <functional>
 #include <span>
 #include <string>
 #include <vector>
 
+/**
+ * networkfs_http_configure - tune the connection pool.
+ * @pool_size:    Maximum number of simultaneously open server connections.
+ *                Calls beyond that are queued until one becomes free.
+ * @idle_timeout: Seconds after which an idle connection is considered stale
+ *                and is reopened instead of reused.
+ * @io_uring:     Do socket I/O through an io_uring instead of epoll. Falls
+ *                back to epoll, with a message on stderr, if the kernel lacks
+ *                multishot recv or provided buffer rings (Linux 6.0).
+ *
+ * Connections are kept alive between calls and shared by the whole process.
+ * Should be called before the first networkfs_http_call().
+ */
+void networkfs_http_configure(size_t pool_size, unsigned idle_timeout,
+                              bool io_uring);
+
 /**
  * networkfs_http_call - make a call to networkfs API.
  * @token:           Unique filesystem token.
@@ -15,6 +32,12 @@
  * @args:            A vector of key-value pairs for the GET parameters.
  *
  * This method makes an HTTP call to networkfs API server and parses the result.
+ * The request goes over a pooled keep-alive connection; a connection that
+ * turns out to be closed by the server is transparently reopened.
+ *
+ * It is a thin wrapper around networkfs_http_call_async(): it starts the call
+ * and runs networkfs_http_wait() until it has finished. Completions of other
+ * pending async calls may run in the meantime.
  *
  * Return:
  * * If HTTP session succeeds, returns `result->status`.
@@ -27,4 +50,85 @@ int64_t networkfs_http_call(
     size_t buffer_size,
     std::span<const std::pair<std::string, std::string>> args);
 
+/*
+ * networkfs_http_callback - completion of networkfs_http_call_async().
+ * @result:   Same as the return value of networkfs_http_call().
+ * @response: Response payload, zero-padded to the requested buffer size.
+ *            Only valid until the callback returns.
+ */
+using networkfs_http_callback =
+    std::function<void(int64_t result, const char* response)>;
+
+/**
+ * networkfs_http_call_async - start a call to networkfs API.
+ * @token:       Unique filesystem token.
+ * @method:      API method name, e.g. "list" for fs.list.
+ * @buffer_size: Maximum accepted size of the response payload.
+ * @args:        A vector of key-value pairs for the GET parameters.
+ * @done:        Invoked once the call has finished.
+ *
+ * Sends the request over a non-blocking keep-alive connection and returns
+ * without waiting for the response. Many calls may be in flight at once; they
+ * are spread over up to `pool_size` connections and queued beyond that.
+ * A "lookup", "list" or "read" made while the same call is already in flight
+ * is not sent again; it completes from the response to the earlier one.
+ *
+ * @done is invoked from networkfs_http_process() when the response arrives,
+ * or right away if no connection could be established.
+ *
+ * All functions in this header are thread-safe. Callbacks are invoked from
+ * whichever thread happens to be running networkfs_http_process(), only the
+ * attached one if any (see networkfs_http_attach()), and may start further
+ * calls.
+ */
+void networkfs_http_call_async(
+    const char* token, const char* method, size_t buffer_size,
+    std::span<const std::pair<std::string, std::string>> args,
+    networkfs_http_callback done);
+
+/**
+ * networkfs_http_fd - file descriptor to wait on for async call progress.
+ *
+ * Return: an epoll descriptor which becomes readable whenever
+ * networkfs_http_process() has work to do.
+ */
+int networkfs_http_fd();
+
+/**
+ * networkfs_http_process - advance in-flight async calls.
+ *
+ * Performs all non-blocking socket I/O that is ready and invokes completion
+ * callbacks of finished calls. Also times out calls that got no response
+ * within 10 seconds, so it should be called at least once a second while
+ * calls are pending.
+ */
+void networkfs_http_process();
+
+/**
+ * networkfs_http_wait - block until async calls can make progress.
+ *
+ * Sleeps on networkfs_http_fd() for up to a second and then runs
+ * networkfs_http_process(). Useful for callers without an event loop of
+ * their own. While another thread is attached, only sleeps until that
+ * thread has run networkfs_http_process().
+ */
+void networkfs_http_wait();
+
+/**
+ * networkfs_http_attach - drive async calls from the calling thread only.
+ *
+ * For an event loop that runs networkfs_http_process() itself whenever
+ * networkfs_http_fd() is readable. Until networkfs_http_detach(), blocking
+ * calls made on other threads leave all socket I/O and callbacks to it and
+ * just wait for their own call to finish.
+ */
+void networkfs_http_attach();
+
+/**
+ * networkfs_http_detach - undo networkfs_http_attach().
+ *
+ * Must be called from the attached thread.
+ */
+void networkfs_http_detach();
+
 #endif
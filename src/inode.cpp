@@ -7,571 +7,1083 @@
 
 #include <algorithm>
 #include <cerrno>
+#include <cstdint>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <future>
 #include <memory>
+#include <mutex>
 #include <new>
 #include <string>
+#include <utility>
 #include <vector>
 
-#include "http.h"
+#include "api.h"
+#include "cache.h"
+#include "content.h"
+#include "loop.h"
+#include "options.h"
+#include "pagecache.h"
+#include "prefetch.h"
+#include "slab.h"
+#include "task.h"
 #include "util.h"
+#include "writeback.h"
 
-struct entry_info {
-  uint64_t entry_type;
-  uint64_t ino;
+/*
+ * Serialized directory entries: entry i ends at @ends[i] in @data and
+ * carries offset i + 1.
+ */
+struct dir_listing {
+  std::vector<char> data;
+  std::vector<size_t> ends;
 };
 
-struct entry {
-  uint64_t entry_type; 
-  uint64_t ino;
-  char name[256];
+/*
+ * Listing of an open directory, taken at opendir time and serialized both
+ * for readdir (fuse_add_direntry) and readdirplus (fuse_add_direntry_plus).
+ */
+struct dir_snapshot {
+  struct dir_listing plain;
+  struct dir_listing plus;
 };
 
-struct entries {
-  uint64_t entries_count;
-  struct entry entries[16];
-};
 
-struct file_buffer {
-  char* data;
-  size_t size;
-};
+static const struct networkfs_options* networkfs_options(fuse_req_t req) {
+  return (const struct networkfs_options*)fuse_req_userdata(req);
+}
+
+/*
+ * API calls on behalf of @req. In event loop mode they suspend the
+ * handler's coroutine, which then goes on after the handler has returned:
+ * it must not refer to the handler's arguments, only to copies of them.
+ */
+static struct networkfs_api networkfs_api(fuse_req_t req) {
+  const struct networkfs_options* opts = networkfs_options(req);
+  return {opts->token, opts->event_loop != 0};
+}
+
+/*
+ * Returns the cached attributes of @ino, or defaults for an inode of
+ * @entry_type that is not in the cache.
+ */
+static struct networkfs_attr networkfs_attr(fuse_ino_t ino,
+                                            uint64_t entry_type) {
+  struct networkfs_attr attr;
+  if (networkfs_attr_get(ino, &attr) && attr.entry_type == entry_type) {
+    return attr;
+  }
+  attr.entry_type = entry_type;
+  attr.size = entry_type == DT_DIR ? 0 : NETWORKFS_SIZE_UNKNOWN;
+  attr.nlink = entry_type == DT_DIR ? 2 : 1;
+  clock_gettime(CLOCK_REALTIME, &attr.mtime);
+  return attr;
+}
+
+/*
+ * Converts @attr to a stat buffer. Returns how long the kernel may keep it:
+ * attributes with an unknown size must not be cached there.
+ */
+static double networkfs_fill_stat(struct stat* stbuf, fuse_ino_t ino,
+                                  const struct networkfs_attr& attr) {
+  memset(stbuf, 0, sizeof(*stbuf));
+  stbuf->st_ino = ino;
+  stbuf->st_mode =
+      attr.entry_type == DT_DIR ? (S_IFDIR | 0755) : (S_IFREG | 0644);
+  stbuf->st_nlink = attr.nlink;
+  if (attr.size != NETWORKFS_SIZE_UNKNOWN) {
+    stbuf->st_size = attr.size;
+    stbuf->st_blocks = (attr.size + 511) / 512;
+  }
+  stbuf->st_atim = attr.mtime;
+  stbuf->st_mtim = attr.mtime;
+  stbuf->st_ctim = attr.mtime;
+  return attr.size == NETWORKFS_SIZE_UNKNOWN ? 0 : networkfs_cache_ttl();
+}
+
+static void networkfs_reply_attr(fuse_req_t req, fuse_ino_t ino,
+                                 const struct networkfs_attr& attr) {
+  struct stat stbuf;
+  double timeout = networkfs_fill_stat(&stbuf, ino, attr);
+  fuse_reply_attr(req, &stbuf, timeout);
+}
+
+/*
+ * Fills the reply for a name resolving to @dentry. A negative dentry becomes
+ * ino 0, which lets the kernel cache the miss for entry_timeout as well.
+ */
+static void networkfs_fill_entry(struct fuse_entry_param* e,
+                                 const struct networkfs_dentry& dentry) {
+  memset(e, 0, sizeof(*e));
+  e->ino = dentry.ino;
+  e->entry_timeout = networkfs_cache_ttl();
+  if (dentry.ino == 0) {
+    return;
+  }
+  e->attr_timeout = networkfs_fill_stat(
+      &e->attr, dentry.ino, networkfs_attr(dentry.ino, dentry.entry_type));
+}
 
 void networkfs_init(void* userdata, struct fuse_conn_info* conn) {
-  (void)userdata;
+  struct networkfs_options* opts = (struct networkfs_options*)userdata;
   conn->want |= FUSE_CAP_EXPORT_SUPPORT;
-  fprintf(stdout, "capable = %u\n", conn->capable);
+  // Small writes land in the kernel's pages and reach us as page-sized
+  // ones. The handlers check the option, so drop it if the kernel says no.
+  if (opts->writeback_cache && (conn->capable & FUSE_CAP_WRITEBACK_CACHE)) {
+    conn->want |= FUSE_CAP_WRITEBACK_CACHE;
+  } else {
+    opts->writeback_cache = 0;
+  }
+#ifdef FUSE_CAP_OVER_IO_URING
+  if (opts->io_uring && !(conn->capable & FUSE_CAP_OVER_IO_URING)) {
+    fprintf(stderr,
+            "networkfs: kernel offers no FUSE over io_uring, using "
+            "/dev/fuse\n");
+    opts->io_uring = 0;
+  }
+#endif
 }
 
 void networkfs_destroy(void* private_data) {
+  // The flusher needs the token for its last uploads.
+  networkfs_writeback_stop();
+  networkfs_prefetch_stop();
   // Token string, which was allocated in main.
-  free(private_data);
+  free(((struct networkfs_options*)private_data)->token);
 }
 
-void networkfs_lookup(fuse_req_t req, fuse_ino_t parent, const char* name) {
-  const char* token = (const char*)fuse_req_userdata(req);
-  char response[1024] = {};
-  char ino_str[21];
-  ino_to_string(ino_str, parent);
-  std::vector<std::pair<std::string, std::string>> args;
-  args.emplace_back("parent", ino_str);
-  args.emplace_back("name", name);
-  int64_t result = networkfs_http_call(token, "lookup", response, sizeof(response), args);
-  if (result != NFS_SUCCESS) {
-    fuse_reply_err(req, ENOENT);
+/*
+ * file_size - outcome of networkfs_size().
+ * @result: NFS_SUCCESS, or the API status that prevented finding the size.
+ *          NFS_ENOTFILE means the inode turned out to be a directory.
+ * @size:   Size of the file.
+ */
+struct file_size {
+  int64_t result;
+  uint64_t size;
+};
+
+/*
+ * Finds out the size of regular file @ino. Local copies are tried before
+ * the server.
+ */
+static networkfs_task<struct file_size> networkfs_size(fuse_req_t req,
+                                                       fuse_ino_t ino) {
+  // An open file has the most recent size. Its buffer is looked up by inode
+  // rather than taken from a file handle, which setattr may pass for a
+  // directory.
+  struct file_buffer* fb = networkfs_buffer_find(ino);
+  if (fb != nullptr) {
+    uint64_t size;
+    {
+      std::lock_guard<std::mutex> guard(fb->lock);
+      size = fb->size;
+    }
+    networkfs_buffer_unpin(fb);
+    co_return {NFS_SUCCESS, size};
+  }
+
+  struct networkfs_attr attr;
+  if (networkfs_attr_get(ino, &attr) &&
+      attr.size != NETWORKFS_SIZE_UNKNOWN) {
+    co_return {attr.entry_type == DT_DIR ? NFS_ENOTFILE : NFS_SUCCESS,
+               attr.size};
+  }
+
+  std::string content;
+  if (networkfs_writeback_get(ino, &content) ||
+      networkfs_slab_get(ino, &content)) {
+    co_return {NFS_SUCCESS, content.size()};
+  }
+
+  // The API reports a file's size only together with its content. Reading a
+  // directory fails with ENOTFILE, which tells the type in the same call.
+  struct networkfs_response r = co_await networkfs_api(req).read(ino);
+  if (r.result != NFS_SUCCESS) {
+    if (r.result == NFS_ENOTFILE) {
+      networkfs_attr_set_type(ino, DT_DIR);
+    }
+    co_return {r.result, 0};
+  }
+  uint64_t size;
+  memcpy(&size, r.data.data(), sizeof(uint64_t));
+  const char* data = r.data.data() + sizeof(uint64_t);
+  networkfs_attr_set_size(ino, size, false);
+  networkfs_slab_put(ino, data, size);
+  networkfs_pagecache_seen(ino, data, size);
+  co_return {NFS_SUCCESS, size};
+}
+
+static networkfs_task<> networkfs_reply_size(fuse_req_t req, fuse_ino_t ino) {
+  struct file_size size = co_await networkfs_size(req, ino);
+  if (size.result == NFS_SUCCESS) {
+    struct networkfs_attr attr = networkfs_attr(ino, DT_REG);
+    attr.size = size.size;
+    networkfs_reply_attr(req, ino, attr);
+  } else if (size.result == NFS_ENOTFILE) {
+    networkfs_reply_attr(req, ino, networkfs_attr(ino, DT_DIR));
   } else {
-    struct entry_info entry;
-    memcpy(&entry, response, sizeof(entry_info));
-    struct fuse_entry_param e;
-    memset(&e, 0, sizeof(e));
-    e.ino = entry.ino;
-    e.attr_timeout = 0;
-    e.entry_timeout = 0;
-    e.attr.st_ino = entry.ino;
-    e.attr.st_mode = entry.entry_type == DT_DIR ? (S_IFDIR | 0755) : (S_IFREG | 0644);
-    e.attr.st_nlink = entry.entry_type == DT_DIR ? 2 : 1;
-    e.attr.st_size = 0;
-    fuse_reply_entry(req, &e);
+    fuse_reply_err(req, ENOENT);
   }
 }
 
 void networkfs_getattr(fuse_req_t req, fuse_ino_t ino,
                        struct fuse_file_info* fi) {
-  const char* token = (const char*)fuse_req_userdata(req);
-  
-  char response[sizeof(struct entries)] = {};  // Need space for list response
-  char ino_str[21];
-  ino_to_string(ino_str, ino);
-  
-  std::vector<std::pair<std::string, std::string>> args;
-  args.emplace_back("inode", ino_str);
-  
-  struct stat stbuf = {};
-  stbuf.st_ino = ino;
-  
-  // First, check if we have an open file handle with size info
-  if (fi != nullptr && fi->fh != 0) {
-    struct file_buffer* fb = (struct file_buffer*)fi->fh;
-    stbuf.st_mode = S_IFREG | 0644;
-    stbuf.st_nlink = 1;
-    stbuf.st_size = fb->size;
-    fuse_reply_attr(req, &stbuf, 1.0);
+  (void)fi;
+  struct networkfs_attr attr;
+  if (networkfs_attr_get(ino, &attr) && attr.entry_type == DT_DIR) {
+    networkfs_reply_attr(req, ino, attr);
     return;
   }
-  
-  // Try to list the inode as a directory to determine its type
-  int64_t result = networkfs_http_call(token, "list", response, sizeof(response), args);
-  
-  
-  if (result == NFS_SUCCESS) {
-    // It's a directory
-    stbuf.st_mode = S_IFDIR | 0755;
-    stbuf.st_nlink = 2;
-    stbuf.st_size = 0;
-    fuse_reply_attr(req, &stbuf, 1.0);
-  } else if (result == NFS_ENOTDIR) {
-    // It's a file (not a directory)
-    stbuf.st_mode = S_IFREG | 0644;
-    stbuf.st_nlink = 1;
-    stbuf.st_size = 0;  // Size will be updated when file is opened/read
-    fuse_reply_attr(req, &stbuf, 1.0);
-  } else {
+  networkfs_reply_size(req, ino).detach();
+}
+
+/*
+ * Answers a lookup of a name resolving to @dentry. The kernel's writeback
+ * cache trusts the size of a regular file it is first given for as long as
+ * it keeps the inode, so then a size that is not known yet is fetched
+ * before answering rather than left to a later getattr.
+ */
+static networkfs_task<> networkfs_reply_entry(fuse_req_t req,
+                                              struct networkfs_dentry dentry) {
+  struct fuse_entry_param e;
+  struct networkfs_attr attr;
+  if (!networkfs_options(req)->writeback_cache ||
+      dentry.entry_type != DT_REG ||
+      (networkfs_attr_get(dentry.ino, &attr) &&
+       attr.size != NETWORKFS_SIZE_UNKNOWN)) {
+    networkfs_fill_entry(&e, dentry);
+    fuse_reply_entry(req, &e);
+    co_return;
+  }
+
+  struct file_size size = co_await networkfs_size(req, dentry.ino);
+  if (size.result != NFS_SUCCESS) {
+    fuse_reply_err(req, EIO);
+    co_return;
+  }
+  networkfs_fill_entry(&e, dentry);
+  e.attr.st_size = size.size;
+  e.attr.st_blocks = (size.size + 511) / 512;
+  fuse_reply_entry(req, &e);
+}
+
+static networkfs_task<> networkfs_lookup_task(fuse_req_t req,
+                                              fuse_ino_t parent,
+                                              std::string name) {
+  struct networkfs_dentry dentry;
+  if (networkfs_dentry_get(parent, name.c_str(), &dentry)) {
+    co_await networkfs_reply_entry(req, dentry);
+    co_return;
+  }
+
+  struct networkfs_response r =
+      co_await networkfs_api(req).lookup(parent, name);
+  if (r.result == NFS_ENOENT_DIR) {
+    // Remember the miss: probing for absent names is common.
+    dentry = {0, 0};
+    networkfs_dentry_put(parent, name.c_str(), dentry);
+
+    struct fuse_entry_param e;
+    networkfs_fill_entry(&e, dentry);
+    fuse_reply_entry(req, &e);
+    co_return;
+  }
+  if (r.result != NFS_SUCCESS) {
     fuse_reply_err(req, ENOENT);
+    co_return;
+  }
+  struct entry_info entry;
+  memcpy(&entry, r.data.data(), sizeof(entry_info));
+  dentry = {entry.ino, entry.entry_type};
+  networkfs_dentry_put(parent, name.c_str(), dentry);
+  if (entry.entry_type == DT_REG) {
+    networkfs_readahead_name(parent, name.c_str(), entry.ino);
   }
+  co_await networkfs_reply_entry(req, dentry);
+}
+
+void networkfs_lookup(fuse_req_t req, fuse_ino_t parent, const char* name) {
+  networkfs_lookup_task(req, parent, name).detach();
+}
+
+/*
+ * Answers a readdir request at @off with as many whole entries of @listing
+ * as fit into @size bytes.
+ */
+static void networkfs_reply_listing(fuse_req_t req,
+                                    const struct dir_listing& listing,
+                                    size_t size, off_t off) {
+  // Entry i has offset i + 1, so @off is the index of the first one to send.
+  size_t count = listing.ends.size();
+  size_t first = std::min<size_t>(off, count);
+  size_t begin = first == 0 ? 0 : listing.ends[first - 1];
+  size_t end = begin;
+  for (size_t i = first; i < count && listing.ends[i] - begin <= size; i++) {
+    end = listing.ends[i];
+  }
+
+  fuse_reply_buf(req, listing.data.data() + begin, end - begin);
 }
 
 void networkfs_iterate(fuse_req_t req, fuse_ino_t i_ino, size_t size, off_t off,
                        struct fuse_file_info* fi) {
-  (void)fi;
-  const char* token = (const char*)fuse_req_userdata(req);
-  
-  char ino_str[21];
-  ino_to_string(ino_str, i_ino);
-  
-  char response[sizeof(struct entries)] = {};
-  std::vector<std::pair<std::string, std::string>> args;
-  args.emplace_back("inode", ino_str);
-  int64_t result = networkfs_http_call(token, "list", response, sizeof(response), args);
-  if (result != NFS_SUCCESS) {
-    fuse_reply_err(req, ENOENT);
-  } else {
-    struct entries dir_entries;
-    memcpy(&dir_entries, response, sizeof(struct entries));
-    
-    char* buf = static_cast<char*>(malloc(size));
-    size_t buf_pos = 0;
-    
-    for (size_t i = off; i < dir_entries.entries_count; i++) {
-      struct entry* e = &dir_entries.entries[i];
-      
-      struct stat stbuf = {};
-      stbuf.st_ino = e->ino;
-      stbuf.st_mode = (e->entry_type == DT_DIR) ? (S_IFDIR | 0755) : (S_IFREG | 0644);
-      stbuf.st_nlink = (e->entry_type == DT_DIR) ? 2 : 1;
-      stbuf.st_size = 0;
-      
-      size_t entry_size = fuse_add_direntry(req, nullptr, 0, e->name, &stbuf, i + 1);
-      if (buf_pos + entry_size > size) {
-        break;
-      }
-      
-      buf_pos += fuse_add_direntry(req, buf + buf_pos, size - buf_pos, e->name, &stbuf, i + 1);
+  (void)i_ino;
+  const struct dir_snapshot* snapshot = (const struct dir_snapshot*)fi->fh;
+  if (snapshot == nullptr) {
+    fuse_reply_err(req, EIO);
+    return;
+  }
+  networkfs_reply_listing(req, snapshot->plain, size, off);
+}
+
+void networkfs_readdirplus(fuse_req_t req, fuse_ino_t i_ino, size_t size,
+                           off_t off, struct fuse_file_info* fi) {
+  (void)i_ino;
+  const struct dir_snapshot* snapshot = (const struct dir_snapshot*)fi->fh;
+  if (snapshot == nullptr) {
+    fuse_reply_err(req, EIO);
+    return;
+  }
+  networkfs_reply_listing(req, snapshot->plus, size, off);
+}
+
+static networkfs_task<> networkfs_create_task(fuse_req_t req,
+                                              fuse_ino_t parent,
+                                              std::string name,
+                                              struct fuse_file_info fi) {
+  struct networkfs_response r =
+      co_await networkfs_api(req).create(parent, name, "file");
+  if (r.result != NFS_SUCCESS) {
+    // Map error codes: 5=EEXIST, 7=ENOSPC (too many entries)
+    int err = (r.result == 5) ? EEXIST : (r.result == 7) ? ENOSPC : EIO;
+    if (err == EEXIST) {
+      // Whatever we cached about the name is out of date.
+      networkfs_dentry_drop(parent, name.c_str());
     }
-    
-    fuse_reply_buf(req, buf, buf_pos);
-    free(buf);
+    fuse_reply_err(req, err);
+    co_return;
+  }
+  // Response structure: [ino: 8 bytes] (status already stripped)
+  uint64_t ino;
+  memcpy(&ino, r.data.data(), sizeof(uint64_t));
+
+  // Allocate file buffer for new empty file
+  struct file_buffer* fb = networkfs_buffer_acquire(ino);
+  if (fb == nullptr) {
+    fuse_reply_err(req, ENOMEM);
+    co_return;
+  }
+  switch (networkfs_buffer_load(fb, [](int) {})) {
+    case NETWORKFS_BUFFER_CLAIMED:
+      networkfs_buffer_loaded(fb, 0);
+      networkfs_buffer_unpin(fb);
+      break;
+    case NETWORKFS_BUFFER_LOADED:
+      networkfs_buffer_unpin(fb);
+      break;
+    case NETWORKFS_BUFFER_QUEUED:
+      break;
+  }
+  fi.fh = (uint64_t)fb;
+
+  struct networkfs_dentry dentry = {ino, DT_REG};
+  networkfs_dir_invalidate(parent);
+  networkfs_dentry_put(parent, name.c_str(), dentry);
+  networkfs_attr_set_size(ino, 0, true);
+  // Replaces whatever a removed file with this number left behind
+  networkfs_slab_put(ino, nullptr, 0);
+
+  struct fuse_entry_param e;
+  networkfs_fill_entry(&e, dentry);
+  if (fuse_reply_create(req, &e, &fi) == -ENOENT) {
+    // The request was interrupted while the call was in flight.
+    networkfs_buffer_release(fb);
   }
 }
 
 void networkfs_create(fuse_req_t req, fuse_ino_t parent, const char* name,
                       mode_t mode, struct fuse_file_info* fi) {
   (void)mode;
-  const char* token = (const char*)fuse_req_userdata(req);
-  char response[1024] = {};
-  char parent_str[21];
-  ino_to_string(parent_str, parent);
-  
-  std::vector<std::pair<std::string, std::string>> args;
-  args.emplace_back("parent", parent_str);
-  args.emplace_back("name", name);
-  args.emplace_back("type", "file");
-  
-  int64_t result = networkfs_http_call(token, "create", response, sizeof(response), args);
-  if (result != NFS_SUCCESS) {
-    // Map error codes: 5=EEXIST, 7=ENOSPC (too many entries)
-    int err = (result == 5) ? EEXIST : (result == 7) ? ENOSPC : EIO;
+  networkfs_create_task(req, parent, name, *fi).detach();
+}
+
+static networkfs_task<> networkfs_unlink_task(fuse_req_t req,
+                                              fuse_ino_t parent,
+                                              std::string name) {
+  struct networkfs_response r =
+      co_await networkfs_api(req).unlink(parent, name);
+  struct networkfs_dentry dentry;
+  if (networkfs_dentry_get(parent, name.c_str(), &dentry)) {
+    if (r.result == NFS_SUCCESS && dentry.ino != 0) {
+      if (networkfs_attr_link(dentry.ino, -1)) {
+        // Pending content would only be rejected by the server
+        networkfs_writeback_drop(dentry.ino);
+      }
+      networkfs_slab_drop(dentry.ino);
+    }
+    networkfs_dentry_drop(parent, name.c_str());
+  }
+  if (r.result == NFS_SUCCESS) {
+    networkfs_dentry_put(parent, name.c_str(), {0, 0});
+  }
+  if (r.result != NFS_SUCCESS) {
+    // Map error codes: 4=ENOENT (not found), 2=EISDIR (is a directory)
+    int err = (r.result == 4) ? ENOENT : (r.result == 2) ? EISDIR : EIO;
     fuse_reply_err(req, err);
   } else {
-    // Response structure: [ino: 8 bytes] (status already stripped by http_call)
-    uint64_t ino;
-    memcpy(&ino, response, sizeof(uint64_t));
-    
-    // Allocate file buffer for new empty file
-    struct file_buffer* fb = new (std::nothrow) file_buffer;
-    if (fb == nullptr) {
-      fuse_reply_err(req, ENOMEM);
-      return;
-    }
-    fb->data = nullptr;
-    fb->size = 0;
-    fi->fh = (uint64_t)fb;
-    
-    struct fuse_entry_param e;
-    memset(&e, 0, sizeof(e));
-    e.ino = ino;
-    e.attr_timeout = 0;
-    e.entry_timeout = 0;
-    e.attr.st_ino = ino;
-    e.attr.st_mode = S_IFREG | 0644;
-    e.attr.st_nlink = 1;
-    e.attr.st_size = 0;
-    fuse_reply_create(req, &e, fi);
+    fuse_reply_err(req, 0);
   }
 }
 
 void networkfs_unlink(fuse_req_t req, fuse_ino_t parent, const char* name) {
-  const char* token = (const char*)fuse_req_userdata(req);
-  char response[1024] = {};
-  char parent_str[21];
-  ino_to_string(parent_str, parent);
-  
-  std::vector<std::pair<std::string, std::string>> args;
-  args.emplace_back("parent", parent_str);
-  args.emplace_back("name", name);
-  
-  int64_t result = networkfs_http_call(token, "unlink", response, sizeof(response), args);
-  if (result != NFS_SUCCESS) {
-    // Map error codes: 4=ENOENT (not found), 2=EISDIR (is a directory)
-    int err = (result == 4) ? ENOENT : (result == 2) ? EISDIR : EIO;
+  networkfs_unlink_task(req, parent, name).detach();
+}
+
+static networkfs_task<> networkfs_mkdir_task(fuse_req_t req,
+                                             fuse_ino_t parent,
+                                             std::string name) {
+  struct networkfs_response r =
+      co_await networkfs_api(req).create(parent, name, "directory");
+  if (r.result != NFS_SUCCESS) {
+    // Map error codes: 5=EEXIST, 7=ENOSPC (too many entries)
+    int err = (r.result == 5) ? EEXIST : (r.result == 7) ? ENOSPC : EIO;
+    if (err == EEXIST) {
+      // Whatever we cached about the name is out of date.
+      networkfs_dentry_drop(parent, name.c_str());
+    }
     fuse_reply_err(req, err);
-  } else {
-    fuse_reply_err(req, 0);
+    co_return;
   }
+  // Response structure: [ino: 8 bytes] (status already stripped)
+  uint64_t ino;
+  memcpy(&ino, r.data.data(), sizeof(uint64_t));
+
+  struct networkfs_dentry dentry = {ino, DT_DIR};
+  networkfs_dir_invalidate(parent);
+  networkfs_dentry_put(parent, name.c_str(), dentry);
+  // A new directory is empty, so misses in it need no server call.
+  networkfs_dir_set_complete(ino);
+
+  struct fuse_entry_param e;
+  networkfs_fill_entry(&e, dentry);
+  fuse_reply_entry(req, &e);
 }
 
 void networkfs_mkdir(fuse_req_t req, fuse_ino_t parent, const char* name,
                      mode_t mode) {
   (void)mode;
-  const char* token = (const char*)fuse_req_userdata(req);
-  char response[1024] = {};
-  char parent_str[21];
-  ino_to_string(parent_str, parent);
-  
-  std::vector<std::pair<std::string, std::string>> args;
-  args.emplace_back("parent", parent_str);
-  args.emplace_back("name", name);
-  args.emplace_back("type", "directory");
-  
-  int64_t result = networkfs_http_call(token, "create", response, sizeof(response), args);
-  if (result != NFS_SUCCESS) {
-    // Map error codes: 5=EEXIST, 7=ENOSPC (too many entries)
-    int err = (result == 5) ? EEXIST : (result == 7) ? ENOSPC : EIO;
+  networkfs_mkdir_task(req, parent, name).detach();
+}
+
+static networkfs_task<> networkfs_rmdir_task(fuse_req_t req,
+                                             fuse_ino_t parent,
+                                             std::string name) {
+  struct networkfs_response r = co_await networkfs_api(req).rmdir(parent, name);
+  struct networkfs_dentry dentry;
+  if (networkfs_dentry_get(parent, name.c_str(), &dentry) &&
+      dentry.ino != 0) {
+    networkfs_dentry_drop_dir(dentry.ino);
+    networkfs_attr_drop(dentry.ino);
+  }
+  networkfs_dentry_drop(parent, name.c_str());
+  if (r.result == NFS_SUCCESS) {
+    networkfs_dentry_put(parent, name.c_str(), {0, 0});
+  }
+  if (r.result != NFS_SUCCESS) {
+    // Map error codes: 4=ENOENT (not found), 8=ENOTEMPTY (not empty)
+    int err = (r.result == 4) ? ENOENT : (r.result == 8) ? ENOTEMPTY : EIO;
     fuse_reply_err(req, err);
   } else {
-    // Response structure: [ino: 8 bytes] (status already stripped by http_call)
-    uint64_t ino;
-    memcpy(&ino, response, sizeof(uint64_t));
-    
-    struct fuse_entry_param e;
-    memset(&e, 0, sizeof(e));
-    e.ino = ino;
-    e.attr_timeout = 0;
-    e.entry_timeout = 0;
-    e.attr.st_ino = ino;
-    e.attr.st_mode = S_IFDIR | 0755;
-    e.attr.st_nlink = 2;
-    e.attr.st_size = 0;
-    fuse_reply_entry(req, &e);
+    fuse_reply_err(req, 0);
   }
 }
 
 void networkfs_rmdir(fuse_req_t req, fuse_ino_t parent, const char* name) {
-  const char* token = (const char*)fuse_req_userdata(req);
-  char response[1024] = {};
-  char parent_str[21];
-  ino_to_string(parent_str, parent);
-  
-  std::vector<std::pair<std::string, std::string>> args;
-  args.emplace_back("parent", parent_str);
-  args.emplace_back("name", name);
-  
-  int64_t result = networkfs_http_call(token, "rmdir", response, sizeof(response), args);
-  if (result != NFS_SUCCESS) {
-    // Map error codes: 4=ENOENT (not found), 8=ENOTEMPTY (not empty)
-    int err = (result == 4) ? ENOENT : (result == 8) ? ENOTEMPTY : EIO;
+  networkfs_rmdir_task(req, parent, name).detach();
+}
+
+/*
+ * Makes sure @fb holds the content of @ino and pins it. Returns 0, and the
+ * caller unpins the buffer when done with it, or a positive errno if the
+ * content cannot be had. Unless another handler already is, the content is
+ * loaded from the write-back store, the content cache or the server.
+ *
+ * @keep tells whether the caller needs the old bytes at all. If not and the
+ * content is not loaded yet, the buffer starts out empty, and dirty because
+ * the server still has the old content; the caller is about to replace all
+ * of it.
+ *
+ * A load by another handler is awaited like an API call: in event loop mode
+ * the coroutine is resumed by that handler, otherwise the handler's thread
+ * waits for it, as an io_uring queue takes replies only from the thread
+ * that serves it.
+ */
+static networkfs_task<int> networkfs_load(fuse_req_t req, fuse_ino_t ino,
+                                          struct file_buffer* fb, bool keep) {
+  bool wait = !networkfs_options(req)->event_loop;
+  while (true) {
+    // What networkfs_buffer_load() said and, if another handler was loading
+    // the content, how that went
+    auto [state, err] = co_await networkfs_completion<
+        std::pair<enum networkfs_buffer_state, int>>([fb, wait](auto done) {
+      std::promise<int> loader;
+      std::function<void(int err)> ready = [done](int err) {
+        done({NETWORKFS_BUFFER_QUEUED, err});
+      };
+      if (wait) {
+        ready = [&loader](int err) { loader.set_value(err); };
+      }
+      enum networkfs_buffer_state state = networkfs_buffer_load(fb, ready);
+      if (state != NETWORKFS_BUFFER_QUEUED) {
+        done({state, 0});
+      } else if (wait) {
+        done({state, loader.get_future().get()});
+      }
+    });
+    if (state == NETWORKFS_BUFFER_CLAIMED) {
+      break;
+    }
+    if (state == NETWORKFS_BUFFER_LOADED || err != 0) {
+      co_return err;
+    }
+    // Loaded by the other handler: ask again to pin it, unless it has been
+    // evicted meanwhile
+  }
+
+  if (!keep) {
+    {
+      std::lock_guard<std::mutex> guard(fb->lock);
+      fb->generation++;
+    }
+    networkfs_buffer_loaded(fb, 0);
+    co_return 0;
+  }
+
+  // Content waiting for write-back is newer than the server's; a fresh
+  // on-disk copy saves the round trip.
+  std::string content;
+  if (networkfs_writeback_get(ino, &content) ||
+      networkfs_slab_get(ino, &content)) {
+    networkfs_attr_set_size(ino, content.size(), false);
+    bool ok;
+    {
+      std::lock_guard<std::mutex> guard(fb->lock);
+      ok = networkfs_buffer_assign(fb, content.data(), content.size());
+    }
+    int err = ok ? 0 : ENOMEM;
+    networkfs_buffer_loaded(fb, err);
+    co_return err;
+  }
+
+  struct networkfs_response r = co_await networkfs_api(req).read(ino);
+  int err = EIO;
+  if (r.result == NFS_SUCCESS) {
+    // Parse response: [content_length: 8 bytes][content: up to 512 bytes]
+    // (status already stripped)
+    uint64_t size;
+    memcpy(&size, r.data.data(), sizeof(uint64_t));
+    const char* data = r.data.data() + sizeof(uint64_t);
+    networkfs_attr_set_size(ino, size, false);
+    networkfs_slab_put(ino, data, size);
+    networkfs_pagecache_seen(ino, data, size);
+
+    std::lock_guard<std::mutex> guard(fb->lock);
+    err = networkfs_buffer_assign(fb, data, size) ? 0 : ENOMEM;
+  }
+  networkfs_buffer_loaded(fb, err);
+  co_return err;
+}
+
+/*
+ * Finishes an open that needs the content: truncates it for O_TRUNC, or
+ * compares it with what the kernel has cached in keep_cache mode.
+ */
+static networkfs_task<> networkfs_open_task(fuse_req_t req, fuse_ino_t ino,
+                                            struct fuse_file_info fi,
+                                            struct file_buffer* fb) {
+  // Truncating: the old content is not needed
+  bool truncate = fi.flags & O_TRUNC;
+  int err = co_await networkfs_load(req, ino, fb, !truncate);
+  if (err == 0) {
+    {
+      std::lock_guard<std::mutex> guard(fb->lock);
+      if (truncate) {
+        err = networkfs_buffer_resize(fb, 0) ? 0 : ENOMEM;
+      } else {
+        fi.keep_cache = networkfs_pagecache_keep(ino, fb->data, fb->size);
+      }
+    }
+    networkfs_buffer_unpin(fb);
+  }
+  if (err != 0) {
+    networkfs_buffer_release(fb);
     fuse_reply_err(req, err);
-  } else {
-    fuse_reply_err(req, 0);
+    co_return;
+  }
+  if (fuse_reply_open(req, &fi) == -ENOENT) {
+    // The request was interrupted while the content was being loaded.
+    networkfs_buffer_release(fb);
   }
 }
 
 void networkfs_open(fuse_req_t req, fuse_ino_t i_ino, fuse_file_info* fi) {
-  const char* token = (const char*)fuse_req_userdata(req);
-  
-  char ino_str[21];
-  ino_to_string(ino_str, i_ino);
-  
-  // Allocate file buffer
-  struct file_buffer* fb = new (std::nothrow) file_buffer;
+  networkfs_readahead_open(i_ino);
+
+  // Handles of the same inode share one buffer
+  struct file_buffer* fb = networkfs_buffer_acquire(i_ino);
   if (fb == nullptr) {
     fuse_reply_err(req, ENOMEM);
     return;
   }
-  
-  // Check if O_TRUNC flag is set - if so, start with empty file
-  if (fi->flags & O_TRUNC) {
-    // Truncate: start with empty buffer
-    fb->data = nullptr;
-    fb->size = 0;
-  } else {
-    // Read file content from server
-    char response[1024] = {};
-    std::vector<std::pair<std::string, std::string>> args;
-    args.emplace_back("inode", ino_str);
-    
-    int64_t result = networkfs_http_call(token, "read", response, sizeof(response), args);
-    
-    if (result == NFS_SUCCESS) {
-      // Parse response: [content_length: 8 bytes][content: up to 512 bytes] (status already stripped)
-      uint64_t size = *((uint64_t*)(response));
-      
-      fb->size = size;
-      if (size > 0) {
-        fb->data = (char*)malloc(size);
-        if (fb->data == nullptr) {
-          delete fb;
-          fuse_reply_err(req, ENOMEM);
-          return;
-        }
-        // Copy content (skip content_length = 8 bytes)
-        memcpy(fb->data, response + sizeof(uint64_t), size);
-      } else {
-        fb->data = nullptr;
+  fi->fh = (uint64_t)fb;
+
+  // The content is fetched by the first read, or write, that needs it
+  if (!(fi->flags & O_TRUNC)) {
+    if (!networkfs_options(req)->keep_cache) {
+      if (fuse_reply_open(req, fi) == -ENOENT) {
+        // The request was interrupted.
+        networkfs_buffer_release(fb);
       }
-    } else {
-      // File might be newly created or empty - start with empty buffer
-      fb->data = nullptr;
-      fb->size = 0;
+      return;
+    }
+
+    // The kernel's pages are still good if the metadata says nothing has
+    // changed, or if the content turns out to be what they were read from.
+    if (networkfs_pagecache_current(i_ino)) {
+      fi->keep_cache = 1;
+      if (fuse_reply_open(req, fi) == -ENOENT) {
+        networkfs_buffer_release(fb);
+      }
+      return;
     }
   }
-  
-  fi->fh = (uint64_t)fb;
-  fuse_reply_open(req, fi);
+  networkfs_open_task(req, i_ino, *fi, fb).detach();
 }
 
-void networkfs_release(fuse_req_t req, fuse_ino_t ino,
-                       struct fuse_file_info* fi) {
-  (void)ino;
-  struct file_buffer* fb = (struct file_buffer*)fi->fh;
-  if (fb != nullptr) {
-    if (fb->data != nullptr) {
-      free(fb->data);
+/*
+ * Answers a read of @size bytes at @off straight from the content of @fb.
+ * The caller's pin, dropped here, keeps the buffer alive while the reply is
+ * sent with the lock held: the reply may let the last handle be released.
+ */
+static void networkfs_reply_content(fuse_req_t req, struct file_buffer* fb,
+                                    size_t size, off_t off) {
+  {
+    std::lock_guard<std::mutex> guard(fb->lock);
+    // FUSE_BUFVEC_INIT() is a compound literal, which C++ does not have
+    struct fuse_bufvec bv = {};
+    bv.count = 1;
+    if ((size_t)off < fb->size) {
+      bv.buf[0].mem = fb->data + off;
+      bv.buf[0].size = std::min(size, fb->size - off);
     }
-    delete fb;
+    fuse_reply_data(req, &bv, (enum fuse_buf_copy_flags)0);
   }
-  fuse_reply_err(req, 0);
+  networkfs_buffer_unpin(fb);
+}
+
+static networkfs_task<> networkfs_read_task(fuse_req_t req, fuse_ino_t ino,
+                                            struct file_buffer* fb,
+                                            size_t size, off_t off) {
+  int err = co_await networkfs_load(req, ino, fb, true);
+  if (err != 0) {
+    fuse_reply_err(req, err);
+    co_return;
+  }
+  networkfs_reply_content(req, fb, size, off);
 }
 
 void networkfs_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
                     struct fuse_file_info* fi) {
-  (void)ino;
   struct file_buffer* fb = (struct file_buffer*)fi->fh;
   
   if (fb == nullptr) {
     fuse_reply_err(req, EIO);
     return;
   }
-  
-  size_t bytes_to_read = size;
-  if ((size_t)off >= fb->size) {
-    fuse_reply_buf(req, nullptr, 0);
+
+  struct file_buffer* loaded = networkfs_buffer_find(ino);
+  if (loaded != nullptr) {
+    networkfs_reply_content(req, loaded, size, off);
     return;
   }
-  
-  if ((size_t)off + size > fb->size) {
-    bytes_to_read = fb->size - off;
+
+  // Until a handler loads the buffer, the content cache has the bytes the
+  // load would copy into it; send them from where they are. Content waiting
+  // for write-back is newer, so then the buffer is loaded from it.
+  std::string pending;
+  if (!networkfs_writeback_get(ino, &pending) &&
+      networkfs_slab_send(ino, [req, size, off](const char* data,
+                                                size_t length) {
+        struct fuse_bufvec bv = {};
+        bv.count = 1;
+        if ((size_t)off < length) {
+          bv.buf[0].mem = (void*)(data + off);
+          bv.buf[0].size = std::min(size, length - off);
+        }
+        fuse_reply_data(req, &bv, (enum fuse_buf_copy_flags)0);
+      })) {
+    return;
   }
-  
-  fuse_reply_buf(req, fb->data + off, bytes_to_read);
+
+  networkfs_read_task(req, ino, fb, size, off).detach();
 }
 
-void networkfs_write(fuse_req_t req, fuse_ino_t ino, const char* buffer,
-                     size_t size, off_t off, struct fuse_file_info* fi) {
-  (void)ino;
+static networkfs_task<> networkfs_write_task(fuse_req_t req, fuse_ino_t ino,
+                                             struct file_buffer* fb,
+                                             std::string data, off_t off) {
+  // Handles that could do without the old content, O_TRUNC opens and
+  // created files, have loaded the buffer already. A cached size may be
+  // stale, so even a write covering all of it keeps the rest.
+  int err = co_await networkfs_load(req, ino, fb, true);
+  if (err == 0) {
+    {
+      std::lock_guard<std::mutex> guard(fb->lock);
+      if (!networkfs_buffer_write(fb, data.data(), data.size(), off)) {
+        err = ENOMEM;
+      }
+    }
+    networkfs_buffer_unpin(fb);
+  }
+  if (err != 0) {
+    fuse_reply_err(req, err);
+    co_return;
+  }
+  fuse_reply_write(req, data.size());
+}
+
+void networkfs_write_buf(fuse_req_t req, fuse_ino_t ino,
+                         struct fuse_bufvec* bufv, off_t off,
+                         struct fuse_file_info* fi) {
   struct file_buffer* fb = (struct file_buffer*)fi->fh;
   
   if (fb == nullptr) {
     fuse_reply_err(req, EIO);
     return;
   }
-  
-  size_t new_size = off + size;
-  
-  // Expand buffer if needed
-  if (new_size > fb->size) {
-    char* new_data = (char*)realloc(fb->data, new_size);
-    if (new_data == nullptr) {
-      fuse_reply_err(req, ENOMEM);
+
+  // A loaded buffer takes the data straight from the request, even while it
+  // is still in the pipe it was spliced to.
+  struct file_buffer* loaded = networkfs_buffer_find(ino);
+  if (loaded != nullptr) {
+    ssize_t written;
+    {
+      std::lock_guard<std::mutex> guard(loaded->lock);
+      written = networkfs_buffer_copy(loaded, bufv, off);
+    }
+    networkfs_buffer_unpin(loaded);
+    if (written < 0) {
+      fuse_reply_err(req, -written);
       return;
     }
-    // Zero out the gap if writing beyond current size
-    if ((size_t)off > fb->size) {
-      memset(new_data + fb->size, 0, off - fb->size);
+    fuse_reply_write(req, written);
+    return;
+  }
+
+  // The write may complete after the request data is gone
+  std::string data(fuse_buf_size(bufv), '\0');
+  struct fuse_bufvec copy = {};
+  copy.count = 1;
+  copy.buf[0].mem = data.data();
+  copy.buf[0].size = data.size();
+  ssize_t copied = fuse_buf_copy(&copy, bufv, (enum fuse_buf_copy_flags)0);
+  if (copied < 0) {
+    fuse_reply_err(req, -copied);
+    return;
+  }
+  data.resize(copied);
+
+  networkfs_write_task(req, ino, fb, std::move(data), off).detach();
+}
+
+/*
+ * Uploads the whole content of @fb to the server if it has changed since
+ * the last upload. Returns 0 or a positive errno. Shared by flush, fsync
+ * and release.
+ */
+static networkfs_task<int> networkfs_upload(fuse_req_t req, fuse_ino_t ino,
+                                            struct file_buffer* fb) {
+  // Prepare content for write
+  std::string content;
+  uint64_t generation;
+  {
+    std::lock_guard<std::mutex> guard(fb->lock);
+    generation = fb->generation;
+    if (generation == fb->synced) {
+      co_return 0;
+    }
+    if (fb->data != nullptr && fb->size > 0) {
+      content = std::string(fb->data, fb->size);
     }
-    fb->data = new_data;
-    fb->size = new_size;
   }
-  
-  memcpy(fb->data + off, buffer, size);
-  fuse_reply_write(req, size);
+
+  struct networkfs_response r = co_await networkfs_api(req).write(ino, content);
+  if (r.result != NFS_SUCCESS) {
+    // Stays dirty, so the next flush tries again
+    co_return EIO;
+  }
+  {
+    std::lock_guard<std::mutex> guard(fb->lock);
+    // An overlapping upload of newer content may have finished first
+    if (generation >= fb->synced) {
+      networkfs_slab_put(ino, content.data(), content.size());
+    }
+    fb->synced = std::max(fb->synced, generation);
+  }
+  networkfs_attr_set_size(ino, content.size(), true);
+  co_return 0;
+}
+
+static networkfs_task<> networkfs_reply_upload(fuse_req_t req, fuse_ino_t ino,
+                                               struct file_buffer* fb) {
+  fuse_reply_err(req, co_await networkfs_upload(req, ino, fb));
+}
+
+/*
+ * Write-back counterpart of networkfs_upload(): hands changed content of
+ * @fb to the write-back store. Returns 0 or a positive errno.
+ */
+static int networkfs_store(fuse_ino_t ino, struct file_buffer* fb) {
+  std::lock_guard<std::mutex> guard(fb->lock);
+  if (fb->generation == fb->synced) {
+    return 0;
+  }
+  // The one upload failure we can predict; report it while the caller can
+  // still see it.
+  if (fb->size > MAX_FILE_SIZE) {
+    return EFBIG;
+  }
+  networkfs_writeback_store(ino, std::string(fb->data, fb->size));
+  networkfs_attr_set_size(ino, fb->size, true);
+  fb->synced = fb->generation;
+  return 0;
 }
 
 void networkfs_flush(fuse_req_t req, fuse_ino_t ino,
                      struct fuse_file_info* fi) {
-  const char* token = (const char*)fuse_req_userdata(req);
   struct file_buffer* fb = (struct file_buffer*)fi->fh;
-  
+
   if (fb == nullptr) {
     fuse_reply_err(req, 0);
     return;
   }
-  
-  char ino_str[21];
-  ino_to_string(ino_str, ino);
-  
-  // Prepare content for write
-  std::string content;
-  if (fb->data != nullptr && fb->size > 0) {
-    content = std::string(fb->data, fb->size);
+
+  if (networkfs_writeback_enabled()) {
+    int err = networkfs_store(ino, fb);
+    if (err == 0) {
+      err = networkfs_writeback_error(ino);
+    }
+    fuse_reply_err(req, err);
+    return;
   }
-  
-  std::vector<std::pair<std::string, std::string>> args;
-  args.emplace_back("inode", ino_str);
-  args.emplace_back("content", content);
-  
-  char response[1024] = {};
-  int64_t result = networkfs_http_call(token, "write", response, sizeof(response), args);
-  
-  if (result != NFS_SUCCESS) {
-    fuse_reply_err(req, EIO);
-  } else {
-    fuse_reply_err(req, 0);
+
+  networkfs_reply_upload(req, ino, fb).detach();
+}
+
+/*
+ * Write-back fsync: hands changed content to the store and waits for the
+ * flusher to upload it.
+ */
+static networkfs_task<> networkfs_sync_task(fuse_req_t req, fuse_ino_t ino,
+                                            struct file_buffer* fb) {
+  int err = networkfs_store(ino, fb);
+  if (err == 0) {
+    bool wait = !networkfs_options(req)->event_loop;
+    err = co_await networkfs_completion<int>([ino, wait](auto done) {
+      if (wait) {
+        std::promise<int> synced;
+        networkfs_writeback_sync(
+            ino, [&synced](int err) { synced.set_value(err); });
+        done(synced.get_future().get());
+        return;
+      }
+      // The flusher must not run the handler; go on in the event loop.
+      networkfs_writeback_sync(ino, [done](int err) {
+        networkfs_loop_post([done, err] { done(err); });
+      });
+    });
   }
+  fuse_reply_err(req, err);
 }
 
 void networkfs_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
                      struct fuse_file_info* fi) {
   (void)datasync;
-  const char* token = (const char*)fuse_req_userdata(req);
   struct file_buffer* fb = (struct file_buffer*)fi->fh;
-  
+
   if (fb == nullptr) {
     fuse_reply_err(req, 0);
     return;
   }
-  
-  char ino_str[21];
-  ino_to_string(ino_str, ino);
-  
-  // Prepare content for write
-  std::string content;
-  if (fb->data != nullptr && fb->size > 0) {
-    content = std::string(fb->data, fb->size);
+
+  if (networkfs_writeback_enabled()) {
+    networkfs_sync_task(req, ino, fb).detach();
+    return;
   }
-  
-  std::vector<std::pair<std::string, std::string>> args;
-  args.emplace_back("inode", ino_str);
-  args.emplace_back("content", content);
-  
-  char response[1024] = {};
-  int64_t result = networkfs_http_call(token, "write", response, sizeof(response), args);
-  
-  if (result != NFS_SUCCESS) {
-    fuse_reply_err(req, EIO);
-  } else {
+
+  networkfs_reply_upload(req, ino, fb).detach();
+}
+
+static networkfs_task<> networkfs_release_task(fuse_req_t req, fuse_ino_t ino,
+                                               struct file_buffer* fb) {
+  // With the kernel's writeback cache, pages dirtied through a mapping
+  // may be written after the last flush; they must not die with the buffer.
+  if (networkfs_options(req)->writeback_cache) {
+    if (networkfs_writeback_enabled()) {
+      networkfs_store(ino, fb);
+    } else {
+      co_await networkfs_upload(req, ino, fb);
+    }
+  }
+  networkfs_buffer_release(fb);
+  fuse_reply_err(req, 0);
+}
+
+void networkfs_release(fuse_req_t req, fuse_ino_t ino,
+                       struct fuse_file_info* fi) {
+  struct file_buffer* fb = (struct file_buffer*)fi->fh;
+  if (fb == nullptr) {
     fuse_reply_err(req, 0);
+    return;
   }
+
+  networkfs_release_task(req, ino, fb).detach();
 }
 
-void networkfs_setattr(fuse_req_t req, fuse_ino_t ino, struct stat* attr,
-  int to_set, struct fuse_file_info* fi) {
-  const char* token = (const char*)fuse_req_userdata(req);
-  
-  if (to_set & FUSE_SET_ATTR_SIZE) {
-    // Handle truncate
-    if (fi != nullptr && fi->fh != 0) {
-      // File is open, truncate the buffer
-      struct file_buffer* fb = (struct file_buffer*)fi->fh;
-      
-      size_t new_size = attr->st_size;
-      if (new_size != fb->size) {
-        char* new_data = (char*)realloc(fb->data, new_size);
-        if (new_data == nullptr && new_size > 0) {
-          fuse_reply_err(req, ENOMEM);
-          return;
-        }
-        
-        // Zero out new space if expanding
-        if (new_size > fb->size) {
-          memset(new_data + fb->size, 0, new_size - fb->size);
-        }
-        
-        fb->data = new_data;
-        fb->size = new_size;
+/*
+ * Truncates an open file: only the kept bytes need loading.
+ */
+static networkfs_task<> networkfs_resize_task(fuse_req_t req, fuse_ino_t ino,
+                                              struct file_buffer* fb,
+                                              size_t size,
+                                              struct networkfs_attr attr) {
+  int err = co_await networkfs_load(req, ino, fb, size != 0);
+  if (err == 0) {
+    {
+      std::lock_guard<std::mutex> guard(fb->lock);
+      if (!networkfs_buffer_resize(fb, size)) {
+        err = ENOMEM;
       }
-    } else {
-      // File is not open yet, need to truncate on server
-      // For now, we'll handle truncate to 0 (most common case)
-      if (attr->st_size == 0) {
-        char ino_str[21];
-        ino_to_string(ino_str, ino);
-        
-        std::vector<std::pair<std::string, std::string>> args;
-        args.emplace_back("inode", ino_str);
-        args.emplace_back("content", "");
-        
-        char response[1024] = {};
-        int64_t result = networkfs_http_call(token, "write", response, sizeof(response), args);
-        
-        if (result != NFS_SUCCESS) {
-          fuse_reply_err(req, EIO);
-          return;
-        }
-      }
-      // For non-zero truncate without open file, we'd need to read, truncate, write
-      // For now, just proceed - the size will be handled when file is actually accessed
     }
-    
-    // Return updated attributes
-    struct stat stbuf = {};
-    stbuf.st_ino = ino;
-    stbuf.st_mode = S_IFREG | 0644;
-    stbuf.st_nlink = 1;
-    stbuf.st_size = attr->st_size;
-    fuse_reply_attr(req, &stbuf, 1.0);
-  } else {
+    networkfs_buffer_unpin(fb);
+  }
+  if (err != 0) {
+    fuse_reply_err(req, err);
+    co_return;
+  }
+  networkfs_reply_attr(req, ino, attr);
+}
+
+/*
+ * Truncates a file nobody has open on the server: reads what is kept,
+ * cuts or zero-extends it and writes it back.
+ */
+static networkfs_task<> networkfs_truncate_task(fuse_req_t req,
+                                                fuse_ino_t ino, size_t size,
+                                                struct networkfs_attr attr) {
+  if (size > MAX_FILE_SIZE) {
+    fuse_reply_err(req, EFBIG);
+    co_return;
+  }
+
+  std::string content;
+  if (size != 0 && !networkfs_writeback_get(ino, &content) &&
+      !networkfs_slab_get(ino, &content)) {
+    struct networkfs_response r = co_await networkfs_api(req).read(ino);
+    if (r.result != NFS_SUCCESS) {
+      fuse_reply_err(req, EIO);
+      co_return;
+    }
+    uint64_t length;
+    memcpy(&length, r.data.data(), sizeof(uint64_t));
+    content.assign(r.data.data() + sizeof(uint64_t), length);
+  }
+  content.resize(size);
+
+  if (networkfs_writeback_enabled()) {
+    // Goes through the store so it cannot be overtaken by older content
+    networkfs_writeback_store(ino, content);
+    networkfs_attr_set_size(ino, size, true);
+    networkfs_reply_attr(req, ino, attr);
+    co_return;
+  }
+
+  struct networkfs_response r = co_await networkfs_api(req).write(ino, content);
+  if (r.result != NFS_SUCCESS) {
+    fuse_reply_err(req, EIO);
+    co_return;
+  }
+  networkfs_attr_set_size(ino, size, true);
+  networkfs_slab_put(ino, content.data(), content.size());
+  networkfs_reply_attr(req, ino, attr);
+}
+
+void networkfs_setattr(fuse_req_t req, fuse_ino_t ino, struct stat* attr,
+                       int to_set, struct fuse_file_info* fi) {
+  if (!(to_set & FUSE_SET_ATTR_SIZE)) {
     // For other attributes, just return current state
-    struct stat stbuf = {};
-    stbuf.st_ino = ino;
-    stbuf.st_mode = S_IFREG | 0644;
-    stbuf.st_nlink = 1;
-    stbuf.st_size = 0;
-    fuse_reply_attr(req, &stbuf, 1.0);
+    networkfs_getattr(req, ino, fi);
+    return;
   }
+
+  // Return updated attributes
+  struct networkfs_attr new_attr = networkfs_attr(ino, DT_REG);
+  new_attr.size = attr->st_size;
+
+  // Handle truncate
+  if (fi != nullptr && fi->fh != 0) {
+    struct file_buffer* fb = (struct file_buffer*)fi->fh;
+    networkfs_resize_task(req, ino, fb, attr->st_size, new_attr).detach();
+    return;
+  }
+
+  // Truncating by path a file that another handle has open: change the
+  // shared buffer, which that handle will upload.
+  struct file_buffer* fb = networkfs_buffer_find(ino);
+  if (fb != nullptr) {
+    bool ok;
+    {
+      std::lock_guard<std::mutex> guard(fb->lock);
+      ok = networkfs_buffer_resize(fb, attr->st_size);
+    }
+    networkfs_buffer_unpin(fb);
+    if (!ok) {
+      fuse_reply_err(req, ENOMEM);
+      return;
+    }
+    networkfs_reply_attr(req, ino, new_attr);
+    return;
+  }
+
+  networkfs_truncate_task(req, ino, attr->st_size, new_attr).detach();
 }
 
+static networkfs_task<> networkfs_link_task(fuse_req_t req, fuse_ino_t ino,
+                                            fuse_ino_t newparent,
+                                            std::string name) {
+  struct networkfs_response r =
+      co_await networkfs_api(req).link(ino, newparent, name);
+  if (r.result != NFS_SUCCESS) {
+    networkfs_dentry_drop(newparent, name.c_str());
+    fuse_reply_err(req, EEXIST);
+    co_return;
+  }
+  struct networkfs_dentry dentry = {ino, DT_REG};
+  networkfs_dir_invalidate(newparent);
+  networkfs_dentry_put(newparent, name.c_str(), dentry);
+  networkfs_attr_link(ino, 1);
+
+  struct fuse_entry_param e;
+  networkfs_fill_entry(&e, dentry);
+  // At least 2 links now, even if the others were never looked up
+  e.attr.st_nlink = std::max<nlink_t>(e.attr.st_nlink, 2);
+  fuse_reply_entry(req, &e);
+}
 
 void networkfs_link(fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent,
                     const char* name) {
-  const char* token = (const char*)fuse_req_userdata(req);
-  char response[1024] = {};
-  char ino_str[21];
-  char newparent_str[21];
-  ino_to_string(ino_str, ino);
-  ino_to_string(newparent_str, newparent);
-  
-  std::vector<std::pair<std::string, std::string>> args;
-  args.emplace_back("source", ino_str);
-  args.emplace_back("parent", newparent_str);
-  args.emplace_back("name", name);
-  
-  int64_t result = networkfs_http_call(token, "link", response, sizeof(response), args);
-  if (result != NFS_SUCCESS) {
-    fuse_reply_err(req, EEXIST);
-  } else {
-    struct fuse_entry_param e;
-    memset(&e, 0, sizeof(e));
-    e.ino = ino;
-    e.attr_timeout = 0;
-    e.entry_timeout = 0;
-    e.attr.st_ino = ino;
-    e.attr.st_mode = S_IFREG | 0644;
-    e.attr.st_nlink = 2;  // At least 2 links now
-    e.attr.st_size = 0;
-    fuse_reply_entry(req, &e);
-  }
+  networkfs_link_task(req, ino, newparent, name).detach();
 }
 
 void networkfs_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup) {
@@ -587,17 +1099,82 @@ void networkfs_access(fuse_req_t req, fuse_ino_t ino, int mask) {
   fuse_reply_err(req, 0);
 }
 
+static networkfs_task<> networkfs_opendir_task(fuse_req_t req, fuse_ino_t ino,
+                                               struct fuse_file_info fi) {
+  // Take the listing once; every readdir on this handle is served from it
+  struct networkfs_response r = co_await networkfs_api(req).list(ino);
+  if (r.result != NFS_SUCCESS) {
+    fuse_reply_err(req, r.result == NFS_ENOTDIR ? ENOTDIR : ENOENT);
+    co_return;
+  }
+  const struct entries* dir_entries = (const struct entries*)r.data.data();
+
+  struct dir_snapshot* snapshot = new (std::nothrow) dir_snapshot;
+  if (snapshot == nullptr) {
+    fuse_reply_err(req, ENOMEM);
+    co_return;
+  }
+  snapshot->plain.ends.reserve(dir_entries->entries_count);
+  snapshot->plus.ends.reserve(dir_entries->entries_count);
+
+  std::vector<uint64_t> files;
+  for (size_t i = 0; i < dir_entries->entries_count; i++) {
+    const struct entry* e = &dir_entries->entries[i];
+    struct networkfs_dentry dentry = {e->ino, e->entry_type};
+    networkfs_dentry_put(ino, e->name, dentry);
+    if (e->entry_type == DT_REG) {
+      networkfs_readahead_name(ino, e->name, e->ino);
+      files.push_back(e->ino);
+    }
+
+    struct fuse_entry_param entry;
+    networkfs_fill_entry(&entry, dentry);
+    // Without a size the file is left to a lookup (see
+    // networkfs_reply_entry()); entry ino 0 only skips the attributes.
+    if (networkfs_options(req)->writeback_cache &&
+        e->entry_type == DT_REG && entry.attr_timeout == 0) {
+      entry.ino = 0;
+    }
+
+    struct dir_listing& plain = snapshot->plain;
+    size_t pos = plain.data.size();
+    size_t entry_size =
+        fuse_add_direntry(req, nullptr, 0, e->name, nullptr, 0);
+    plain.data.resize(pos + entry_size);
+    fuse_add_direntry(req, plain.data.data() + pos, entry_size, e->name,
+                      &entry.attr, i + 1);
+    plain.ends.push_back(plain.data.size());
+
+    struct dir_listing& plus = snapshot->plus;
+    pos = plus.data.size();
+    entry_size =
+        fuse_add_direntry_plus(req, nullptr, 0, e->name, nullptr, 0);
+    plus.data.resize(pos + entry_size);
+    fuse_add_direntry_plus(req, plus.data.data() + pos, entry_size,
+                           e->name, &entry, i + 1);
+    plus.ends.push_back(plus.data.size());
+  }
+  // Directories hold at most 16 entries, so a list is never partial.
+  networkfs_dir_set_complete(ino);
+  // Their files are likely opened next
+  if (networkfs_options(req)->prefetch) {
+    networkfs_prefetch_dir(std::move(files));
+  }
+
+  fi.fh = (uint64_t)snapshot;
+  if (fuse_reply_open(req, &fi) == -ENOENT) {
+    // The request was interrupted while the call was in flight.
+    delete snapshot;
+  }
+}
+
 void networkfs_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi) {
-  (void)ino;
-  (void)fi;
-  // Just return success - no special handling needed for opening directories
-  fuse_reply_open(req, fi);
+  networkfs_opendir_task(req, ino, *fi).detach();
 }
 
 void networkfs_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi) {
   (void)ino;
-  (void)fi;
-  // No cleanup needed for directories
+  delete (struct dir_snapshot*)fi->fh;
   fuse_reply_err(req, 0);
 }
 
@@ -614,7 +1191,6 @@ const struct fuse_lowlevel_ops networkfs_oper = {
     .link = networkfs_link,
     .open = networkfs_open,
     .read = networkfs_read,
-    .write = networkfs_write,
     .flush = networkfs_flush,
     .release = networkfs_release,
     .fsync = networkfs_fsync,
@@ -623,4 +1199,6 @@ const struct fuse_lowlevel_ops networkfs_oper = {
     .releasedir = networkfs_releasedir,
     .access = networkfs_access,
     .create = networkfs_create,
+    .write_buf = networkfs_write_buf,
+    .readdirplus = networkfs_readdirplus,
 };
\ No newline at end of file
@@ -0,0 +1,140 @@
+#include "loop.h"
+
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdlib>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#define FUSE_USE_VERSION FUSE_MAKE_VERSION(3, 17)
+#include <fuse_lowlevel.h>
+
+#include "http.h"
+
+// Wake up at least this often to time out stuck API calls.
+#define LOOP_TICK_MS 1000
+
+static struct {
+  std::mutex mutex;
+  // Functions from networkfs_loop_post() not run yet.
+  std::vector<std::function<void()>> posted;
+  // Readable while @posted is not empty, -1 outside of the loop.
+  int post_fd = -1;
+} loop;
+
+void networkfs_loop_post(std::function<void()> fn) {
+  std::lock_guard<std::mutex> lock(loop.mutex);
+  loop.posted.push_back(std::move(fn));
+  if (loop.post_fd >= 0) {
+    eventfd_write(loop.post_fd, 1);
+  }
+}
+
+// Runs the functions posted so far.
+static void loop_run_posted() {
+  std::vector<std::function<void()>> posted;
+  {
+    std::lock_guard<std::mutex> lock(loop.mutex);
+    eventfd_t count;
+    eventfd_read(loop.post_fd, &count);
+    posted.swap(loop.posted);
+  }
+  for (auto& fn : posted) {
+    fn();
+  }
+}
+
+/*
+ * Reads and dispatches every request currently queued on the FUSE device.
+ * Returns a negated errno on failure, 0 otherwise.
+ */
+static int loop_drain_fuse(struct fuse_session* se, struct fuse_buf* fbuf) {
+  while (!fuse_session_exited(se)) {
+    int res = fuse_session_receive_buf(se, fbuf);
+    if (res == -EINTR) {
+      continue;
+    }
+    if (res == -EAGAIN) {
+      return 0;
+    }
+    if (res <= 0) {
+      // 0 means the filesystem has been unmounted.
+      return res;
+    }
+    fuse_session_process_buf(se, fbuf);
+  }
+  return 0;
+}
+
+int networkfs_event_loop(struct fuse_session* se) {
+  int fuse_fd = fuse_session_fd(se);
+  int http_fd = networkfs_http_fd();
+  if (fcntl(fuse_fd, F_SETFL, fcntl(fuse_fd, F_GETFL) | O_NONBLOCK) != 0) {
+    return -errno;
+  }
+
+  int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (epoll_fd < 0) {
+    return -errno;
+  }
+  int post_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (post_fd < 0) {
+    int err = errno;
+    close(epoll_fd);
+    return -err;
+  }
+  {
+    std::lock_guard<std::mutex> lock(loop.mutex);
+    loop.post_fd = post_fd;
+  }
+
+  struct epoll_event ev = {};
+  ev.events = EPOLLIN;
+  ev.data.fd = fuse_fd;
+  epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fuse_fd, &ev);
+  // The transport's own epoll instance is readable whenever any of the HTTP
+  // sockets is, so a single nested descriptor covers all of them.
+  ev.data.fd = http_fd;
+  epoll_ctl(epoll_fd, EPOLL_CTL_ADD, http_fd, &ev);
+  ev.data.fd = post_fd;
+  epoll_ctl(epoll_fd, EPOLL_CTL_ADD, post_fd, &ev);
+
+  // Background threads' calls complete here too, never beside a handler.
+  networkfs_http_attach();
+
+  struct fuse_buf fbuf = {};
+  int res = 0;
+  while (!fuse_session_exited(se) && res == 0) {
+    // Also picks up whatever was posted before the loop started.
+    loop_run_posted();
+
+    struct epoll_event events[3];
+    int n = epoll_wait(epoll_fd, events, 3, LOOP_TICK_MS);
+    if (n < 0 && errno != EINTR) {
+      res = -errno;
+      break;
+    }
+
+    for (int i = 0; i < n && res == 0; i++) {
+      if (events[i].data.fd == fuse_fd) {
+        res = loop_drain_fuse(se, &fbuf);
+      }
+    }
+    networkfs_http_process();
+  }
+
+  networkfs_http_detach();
+  {
+    std::lock_guard<std::mutex> lock(loop.mutex);
+    loop.post_fd = -1;
+  }
+  free(fbuf.mem);
+  close(post_fd);
+  close(epoll_fd);
+  return res;
+}
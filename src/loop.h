@@ -0,0 +1,29 @@
+#pragma once
+
+#include <functional>
+
+struct fuse_session;
+
+/**
+ * networkfs_event_loop - serve FUSE requests from a single-threaded epoll loop.
+ * @se: Mounted session.
+ *
+ * Drop-in replacement for fuse_session_loop(). Both the FUSE device and the
+ * HTTP sockets are switched to non-blocking mode, so handlers can return
+ * while their API calls are still in flight and reply once the responses
+ * arrive. Handlers must use networkfs_http_call_async() in this mode.
+ *
+ * Return: 0 on clean unmount, otherwise a negated errno.
+ */
+int networkfs_event_loop(struct fuse_session* se);
+
+/**
+ * networkfs_loop_post - run a function on the event loop thread.
+ * @fn: Function to run.
+ *
+ * For operations that complete on a thread of their own, like write-back
+ * uploads, but must go on where the handlers run. @fn runs on the next
+ * iteration of networkfs_event_loop(), or on its first one if it has not
+ * started yet. Thread-safe.
+ */
+void networkfs_loop_post(std::function<void()> fn);
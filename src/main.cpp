@@ -1,3 +1,4 @@
+#include <cstddef>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
@@ -8,7 +9,97 @@
 #define FUSE_USE_VERSION FUSE_MAKE_VERSION(3, 17)
 #include <fuse_lowlevel.h>
 
+#include "cache.h"
+#include "content.h"
+#include "http.h"
 #include "inode.h"
+#include "loop.h"
+#include "options.h"
+#include "pagecache.h"
+#include "prefetch.h"
+#include "slab.h"
+#include "writeback.h"
+
+#define NETWORKFS_OPT(t, p) {t, offsetof(struct networkfs_options, p), 1}
+
+static const struct fuse_opt networkfs_opts[] = {
+    NETWORKFS_OPT("pool_size=%u", pool_size),
+    NETWORKFS_OPT("pool_idle_timeout=%u", pool_idle_timeout),
+    NETWORKFS_OPT("event_loop", event_loop),
+    NETWORKFS_OPT("threads=%u", threads),
+    NETWORKFS_OPT("cache_ttl=%lf", cache_ttl),
+    NETWORKFS_OPT("writeback", writeback),
+    NETWORKFS_OPT("writeback_delay=%lf", writeback_delay),
+    NETWORKFS_OPT("writeback_bytes=%u", writeback_bytes),
+    NETWORKFS_OPT("content_cache=%s", content_cache),
+    NETWORKFS_OPT("content_slots=%u", content_slots),
+    NETWORKFS_OPT("content_ttl=%lf", content_ttl),
+    NETWORKFS_OPT("prefetch", prefetch),
+    NETWORKFS_OPT("prefetch_parallel=%u", prefetch_parallel),
+    NETWORKFS_OPT("prefetch_bytes=%u", prefetch_bytes),
+    NETWORKFS_OPT("readahead=%u", readahead),
+    NETWORKFS_OPT("buffer_bytes=%u", buffer_bytes),
+    NETWORKFS_OPT("keep_cache", keep_cache),
+    NETWORKFS_OPT("writeback_cache", writeback_cache),
+    NETWORKFS_OPT("io_uring", io_uring),
+    NETWORKFS_OPT("http_uring", http_uring),
+    FUSE_OPT_END,
+};
+
+static void networkfs_help() {
+  std::cout << "networkfs options:\n"
+            << "    -o pool_size=N          max open server connections "
+               "(default: 4)\n"
+            << "    -o pool_idle_timeout=S  seconds before an idle "
+               "connection is reopened\n"
+            << "                            (default: 15)\n"
+            << "    -o event_loop           serve requests from a "
+               "non-blocking epoll loop\n"
+            << "    -o threads=N            serve requests from N worker "
+               "threads (default: 1)\n"
+            << "    -o cache_ttl=S          seconds to trust cached metadata, "
+               "0 disables\n"
+            << "                            (default: 1)\n"
+            << "    -o writeback            let close return before the "
+               "upload\n"
+            << "    -o writeback_delay=S    seconds a file may stay dirty "
+               "(default: 5)\n"
+            << "    -o writeback_bytes=N    upload at once when more is "
+               "dirty\n"
+            << "                            (default: 65536)\n"
+            << "    -o content_cache=FILE   keep file content in FILE across "
+               "mounts\n"
+            << "    -o content_slots=N      files the content cache holds "
+               "(default: 1024)\n"
+            << "    -o content_ttl=S        seconds cached content stays "
+               "fresh (default: 60)\n"
+            << "    -o prefetch             read the files of listed "
+               "directories ahead\n"
+            << "    -o prefetch_parallel=N  prefetch reads in flight "
+               "(default: 8)\n"
+            << "    -o prefetch_bytes=N     bytes to prefetch per directory "
+               "(default: 65536)\n"
+            << "    -o readahead=N          read up to N files ahead of "
+               "sequential or\n"
+            << "                            repeated opens (default: 0)\n"
+            << "    -o buffer_bytes=N       memory for the content of open "
+               "files before\n"
+            << "                            unmodified ones are dropped "
+               "(default: 16777216)\n"
+            << "    -o keep_cache           let the kernel keep cached pages "
+               "of unchanged\n"
+            << "                            files across opens\n"
+            << "    -o writeback_cache      let the kernel gather writes in "
+               "its page cache;\n"
+            << "                            nothing else may change the "
+               "files meanwhile\n"
+            << "    -o io_uring             take requests from io_uring "
+               "queues, one per CPU,\n"
+            << "                            where the kernel and libfuse "
+               "support it\n"
+            << "    -o http_uring           do server socket I/O through "
+               "io_uring\n\n";
+}
 
 int main(int argc, char* argv[]) {
   fuse_args args = FUSE_ARGS_INIT(argc, argv);
@@ -20,6 +111,7 @@ int main(int argc, char* argv[]) {
 
   if (opts.show_help) {
     std::cout << "usage: " << argv[0] << " [options] <mountpoint>\n\n";
+    networkfs_help();
     fuse_cmdline_help();
     fuse_lowlevel_help();
     return 0;
@@ -39,15 +131,60 @@ int main(int argc, char* argv[]) {
   auto mountpoint =
       std::unique_ptr<char, decltype(&free)>(opts.mountpoint, &free);
 
+  struct networkfs_options options;
+  if (fuse_opt_parse(&args, &options, networkfs_opts, nullptr) != 0) {
+    return 1;
+  }
+  if (options.event_loop && options.threads > 1) {
+    std::cerr << "event_loop and threads are mutually exclusive\n";
+    return 1;
+  }
+  // Ring replies must come from the thread that took the request, which
+  // the event loop's asynchronous completions do not.
+  if (options.event_loop && options.io_uring) {
+    std::cerr << "event_loop and io_uring are mutually exclusive\n";
+    return 1;
+  }
+  if (options.io_uring) {
+#ifdef FUSE_CAP_OVER_IO_URING
+    // libfuse sets the queues up at INIT and stays on /dev/fuse if it
+    // cannot.
+    fuse_opt_add_arg(&args, "-oio_uring");
+#else
+    std::cerr << "networkfs: libfuse " << fuse_pkgversion()
+              << " has no io_uring transport, using /dev/fuse\n";
+    options.io_uring = 0;
+#endif
+  }
+  networkfs_http_configure(options.pool_size, options.pool_idle_timeout,
+                           options.http_uring);
+  networkfs_cache_configure(options.cache_ttl);
+  networkfs_buffer_configure(options.buffer_bytes);
+
   const char* token = getenv("NETWORKFS_TOKEN");
   if (!token) {
     std::cerr << "NETWORKFS_TOKEN environment variable not set\n";
     return 1;
   }
 
+  options.token = strdup(token);
+
+  // Prefetched content needs somewhere to go, if only memory
+  bool prefetch = options.prefetch || options.readahead > 0;
+  if (options.content_cache != nullptr || prefetch) {
+    int err = networkfs_slab_open(options.content_cache, options.content_slots,
+                                  options.content_ttl, options.token);
+    free(options.content_cache);
+    options.content_cache = nullptr;
+    if (err != 0) {
+      std::cerr << "cannot open content cache: " << strerror(err) << "\n";
+      return 1;
+    }
+  }
+
   auto se = std::unique_ptr<fuse_session, decltype(&fuse_session_destroy)>(
       fuse_session_new(&args, &networkfs_oper, sizeof(networkfs_oper),
-                       strdup(token)),
+                       &options),
       &fuse_session_destroy);
 
   if (!se) {
@@ -64,7 +201,38 @@ int main(int argc, char* argv[]) {
 
   fuse_daemonize(opts.foreground);
 
-  int ret = fuse_session_loop(se.get());
+  // Started after daemonizing: threads do not survive the fork.
+  if (options.writeback) {
+    networkfs_writeback_start(options.token, options.writeback_delay,
+                              options.writeback_bytes);
+  }
+  if (options.keep_cache) {
+    networkfs_pagecache_start(se.get());
+  }
+  if (prefetch) {
+    networkfs_prefetch_start(options.token, options.prefetch_parallel,
+                             options.prefetch_bytes, options.readahead);
+  }
+
+  int ret;
+  if (options.event_loop) {
+    ret = networkfs_event_loop(se.get());
+  } else if (options.threads > 1) {
+    // Concurrent handlers share the connection pool, so raise pool_size along
+    // with threads to actually overlap API calls.
+    struct fuse_loop_config* config = fuse_loop_cfg_create();
+    fuse_loop_cfg_set_max_threads(config, options.threads);
+    fuse_loop_cfg_set_clone_fd(config, opts.clone_fd);
+    fuse_loop_cfg_set_idle_threads(config, opts.max_idle_threads);
+    ret = fuse_session_loop_mt(se.get(), config);
+    fuse_loop_cfg_destroy(config);
+  } else {
+    ret = fuse_session_loop(se.get());
+  }
+  networkfs_writeback_stop();
+  networkfs_prefetch_stop();
+  networkfs_pagecache_stop();
+  networkfs_slab_close();
 
   fuse_session_unmount(se.get());
   fuse_remove_signal_handlers(se.get());
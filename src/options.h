@@ -0,0 +1,29 @@
+#pragma once
+
+/*
+ * Mount configuration. Filled from the command line and `-o` options in main
+ * and handed to the handlers as the session's userdata.
+ */
+struct networkfs_options {
+  char* token = nullptr;
+  unsigned pool_size = 4;
+  unsigned pool_idle_timeout = 15;
+  int event_loop = 0;
+  unsigned threads = 1;
+  double cache_ttl = 1.0;
+  int writeback = 0;
+  double writeback_delay = 5.0;
+  unsigned writeback_bytes = 65536;
+  char* content_cache = nullptr;
+  unsigned content_slots = 1024;
+  double content_ttl = 60.0;
+  int prefetch = 0;
+  unsigned prefetch_parallel = 8;
+  unsigned prefetch_bytes = 65536;
+  unsigned readahead = 0;
+  unsigned buffer_bytes = 16 << 20;
+  int keep_cache = 0;
+  int writeback_cache = 0;
+  int io_uring = 0;
+  int http_uring = 0;
+};
@@ -0,0 +1,135 @@
+#include "pagecache.h"
+
+#define FUSE_USE_VERSION FUSE_MAKE_VERSION(3, 17)
+#include <fuse_lowlevel.h>
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+
+#include "cache.h"
+
+/*
+ * Content the kernel may hold pages of, and the attributes cached when it
+ * was recorded.
+ */
+struct pagecache_record {
+  uint64_t hash;
+  size_t size;
+  bool has_mtime;
+  struct timespec mtime;
+};
+
+static struct {
+  std::mutex mutex;
+  // Wakes the invalidation thread: new inode to invalidate or stop.
+  std::condition_variable wake;
+  std::thread worker;
+  struct fuse_session* se = nullptr;
+  bool stopping = false;
+  std::unordered_map<uint64_t, pagecache_record> records;
+  std::deque<uint64_t> invalid;
+} pc;
+
+// FNV-1a
+static uint64_t pagecache_hash(const char* data, size_t size) {
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  for (size_t i = 0; i < size; i++) {
+    hash = (hash ^ (unsigned char)data[i]) * 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+static void pagecache_worker() {
+  std::unique_lock<std::mutex> lock(pc.mutex);
+  while (true) {
+    pc.wake.wait(lock, [] { return pc.stopping || !pc.invalid.empty(); });
+    if (pc.stopping) {
+      return;
+    }
+    uint64_t ino = pc.invalid.front();
+    pc.invalid.pop_front();
+
+    lock.unlock();
+    fuse_lowlevel_notify_inval_inode(pc.se, ino, 0, 0);
+    lock.lock();
+  }
+}
+
+void networkfs_pagecache_start(struct fuse_session* se) {
+  std::lock_guard<std::mutex> lock(pc.mutex);
+  if (pc.se != nullptr) {
+    return;
+  }
+  pc.se = se;
+  pc.stopping = false;
+  pc.worker = std::thread(pagecache_worker);
+}
+
+void networkfs_pagecache_stop() {
+  {
+    std::lock_guard<std::mutex> lock(pc.mutex);
+    if (pc.se == nullptr) {
+      return;
+    }
+    pc.stopping = true;
+    pc.invalid.clear();
+    pc.wake.notify_all();
+  }
+  pc.worker.join();
+
+  std::lock_guard<std::mutex> lock(pc.mutex);
+  pc.se = nullptr;
+  pc.records.clear();
+}
+
+bool networkfs_pagecache_current(uint64_t ino) {
+  std::lock_guard<std::mutex> lock(pc.mutex);
+  auto it = pc.records.find(ino);
+  if (it == pc.records.end() || !it->second.has_mtime) {
+    return false;
+  }
+  struct networkfs_attr attr;
+  return networkfs_attr_get(ino, &attr) && attr.size == it->second.size &&
+         attr.mtime.tv_sec == it->second.mtime.tv_sec &&
+         attr.mtime.tv_nsec == it->second.mtime.tv_nsec;
+}
+
+bool networkfs_pagecache_keep(uint64_t ino, const char* data, size_t size) {
+  std::lock_guard<std::mutex> lock(pc.mutex);
+  if (pc.se == nullptr) {
+    return false;
+  }
+
+  struct pagecache_record record = {pagecache_hash(data, size), size, false,
+                                    {}};
+  struct networkfs_attr attr;
+  if (networkfs_attr_get(ino, &attr) && attr.size == size) {
+    record.has_mtime = true;
+    record.mtime = attr.mtime;
+  }
+
+  auto [it, inserted] = pc.records.try_emplace(ino, record);
+  bool same = !inserted && it->second.hash == record.hash &&
+              it->second.size == record.size;
+  it->second = record;
+  return same;
+}
+
+void networkfs_pagecache_seen(uint64_t ino, const char* data, size_t size) {
+  std::lock_guard<std::mutex> lock(pc.mutex);
+  auto it = pc.records.find(ino);
+  if (it == pc.records.end()) {
+    return;
+  }
+  if (it->second.size == size &&
+      it->second.hash == pagecache_hash(data, size)) {
+    return;
+  }
+  // The next open revalidates against the new content
+  pc.records.erase(it);
+  pc.invalid.push_back(ino);
+  pc.wake.notify_all();
+}
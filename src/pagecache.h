@@ -0,0 +1,65 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+struct fuse_session;
+
+/*
+ * Kernel page cache reuse. Normally every open drops the pages the kernel
+ * cached for the file, so every read comes back to us. In keep_cache mode
+ * an open lets the kernel keep them when the content is known not to have
+ * changed: the metadata cache vouches for it, or the content fetched at open
+ * matches what the kernel was last given. Content found to differ later is
+ * dropped from the kernel through fuse_lowlevel_notify_inval_inode(), from
+ * a thread of its own because the kernel may be waiting on a request for
+ * the same inode.
+ *
+ * All functions are thread-safe and do nothing until
+ * networkfs_pagecache_start().
+ */
+
+/**
+ * networkfs_pagecache_start - enable keep_cache mode.
+ * @se: Session to send invalidations to.
+ */
+void networkfs_pagecache_start(struct fuse_session* se);
+
+/**
+ * networkfs_pagecache_stop - drop pending invalidations and stop.
+ */
+void networkfs_pagecache_stop();
+
+/**
+ * networkfs_pagecache_current - whether the kernel's pages of @ino are
+ * known to be current without fetching anything.
+ * @ino: Inode number.
+ *
+ * True while the cached attributes of @ino are still those recorded by the
+ * last networkfs_pagecache_keep().
+ */
+bool networkfs_pagecache_current(uint64_t ino);
+
+/**
+ * networkfs_pagecache_keep - decide keep_cache for an open.
+ * @ino:  Inode number.
+ * @data: Current content of the file.
+ * @size: Its length.
+ *
+ * Records @data as what the kernel caches from now on.
+ *
+ * Return: true if @data is what the kernel was given before, so its pages
+ * may be kept.
+ */
+bool networkfs_pagecache_keep(uint64_t ino, const char* data, size_t size);
+
+/**
+ * networkfs_pagecache_seen - report content fetched from the server.
+ * @ino:  Inode number.
+ * @data: Content of the file.
+ * @size: Its length.
+ *
+ * If it differs from what the kernel may have cached, the kernel's pages of
+ * @ino are invalidated in the background.
+ */
+void networkfs_pagecache_seen(uint64_t ino, const char* data, size_t size);
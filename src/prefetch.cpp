@@ -0,0 +1,451 @@
+#include "prefetch.h"
+
+#include <dirent.h>
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "cache.h"
+#include "http.h"
+#include "inode.h"
+#include "slab.h"
+#include "util.h"
+
+// Queued jobs beyond this many are dropped, oldest first.
+#define PREFETCH_QUEUE_MAX 64
+// Directories the predictor keeps track of before it starts over.
+#define READAHEAD_DIRS_MAX 1024
+// A prediction not followed by an open within this time was wasted.
+#define READAHEAD_EXPIRE std::chrono::seconds(30)
+// Predictions judged at once by the throttle, and hits needed among them.
+#define READAHEAD_WINDOW 16
+#define READAHEAD_MIN_HITS 4
+
+using prefetch_clock = std::chrono::steady_clock;
+
+/*
+ * Files to fetch: @files by inode, then @names in @parent, which are looked
+ * up first. @next is the first item not started yet and @fetched the bytes
+ * fetched for the job so far. A read is charged MAX_FILE_SIZE when it is
+ * started and settled to the real size when it completes, so reads in
+ * flight cannot overrun the budget.
+ */
+struct prefetch_job {
+  uint64_t parent = 0;
+  std::vector<uint64_t> files;
+  std::vector<std::string> names;
+  size_t next = 0;
+  size_t fetched = 0;
+};
+
+/*
+ * What the predictor knows about one directory: its names in sorted order,
+ * the last file opened in it, how many opens in a row went to the next name,
+ * and which file followed which in earlier passes.
+ */
+struct readahead_dir {
+  std::map<std::string, uint64_t> names;
+  std::string last;
+  unsigned run = 0;
+  std::unordered_map<uint64_t, uint64_t> next;
+};
+
+static struct {
+  std::mutex mutex;
+  // Wakes the idle thread: new job or stop.
+  std::condition_variable wake;
+  std::thread worker;
+  bool running = false;
+  bool stopping = false;
+  const char* token = nullptr;
+  unsigned parallel = 0;
+  size_t budget = 0;
+  // Jobs with items not started yet; the first one is worked on
+  std::deque<std::shared_ptr<prefetch_job>> jobs;
+  // Reads in flight over all jobs
+  unsigned inflight = 0;
+
+  // Readahead predictor
+  unsigned depth = 0;
+  std::unordered_map<uint64_t, readahead_dir> dirs;
+  // Directory and name each file was last seen under
+  std::unordered_map<uint64_t, std::pair<uint64_t, std::string>> files;
+  // Files fetched on a prediction and not opened yet, with when
+  std::unordered_map<uint64_t, prefetch_clock::time_point> speculated;
+  // Totals, reported on stop
+  uint64_t predicted = 0;
+  uint64_t used = 0;
+  uint64_t wasted = 0;
+  // Outcomes in the current throttle window
+  unsigned window = 0;
+  unsigned window_hits = 0;
+  bool throttled = false;
+  // Opens since the last prediction made while throttled
+  unsigned skipped = 0;
+} pf;
+
+/*
+ * Records a speculative fetch of @ino under the lock. Returns false if one
+ * is already waiting to be used.
+ */
+static bool readahead_mark(uint64_t ino) {
+  if (!pf.speculated.try_emplace(ino, prefetch_clock::now()).second) {
+    return false;
+  }
+  pf.predicted++;
+  return true;
+}
+
+// Counts a prediction as used or wasted for the throttle, under the lock.
+static void readahead_judge(bool hit) {
+  pf.window++;
+  pf.window_hits += hit;
+  if (pf.window == READAHEAD_WINDOW) {
+    // Keep guessing only while enough guesses pay off
+    pf.throttled = pf.window_hits < READAHEAD_MIN_HITS;
+    pf.window = 0;
+    pf.window_hits = 0;
+  }
+}
+
+// Notes that @parent has @name, a file, under the lock.
+static void readahead_remember(uint64_t parent, const std::string& name,
+                               uint64_t ino) {
+  if (pf.dirs.size() >= READAHEAD_DIRS_MAX && !pf.dirs.contains(parent)) {
+    pf.dirs.clear();
+    pf.files.clear();
+  }
+  pf.dirs[parent].names[name] = ino;
+  pf.files[ino] = {parent, name};
+}
+
+/*
+ * Starts a background fs/read of @ino. The response is handled by whichever
+ * thread processes HTTP completions, hence the lock.
+ */
+static void prefetch_read(std::shared_ptr<prefetch_job> job, uint64_t ino) {
+  char ino_str[21];
+  ino_to_string(ino_str, ino);
+
+  std::vector<std::pair<std::string, std::string>> args;
+  args.emplace_back("inode", ino_str);
+
+  auto asked = std::chrono::system_clock::now();
+  networkfs_http_call_async(
+      pf.token, "read", 1024, args,
+      [job, ino, asked](int64_t result, const char* response) {
+        size_t size = 0;
+        if (result == NFS_SUCCESS) {
+          uint64_t length;
+          memcpy(&length, response, sizeof(uint64_t));
+          networkfs_slab_fill(ino, response + sizeof(uint64_t), length, asked);
+          size = length;
+        }
+
+        std::lock_guard<std::mutex> lock(pf.mutex);
+        pf.inflight--;
+        job->fetched += size;
+        job->fetched -= MAX_FILE_SIZE;
+      });
+}
+
+/*
+ * Looks @name up in @parent and reads it if it turns out to be a file. Counts
+ * as a single read in flight.
+ */
+static void prefetch_lookup(std::shared_ptr<prefetch_job> job,
+                            const std::string& name) {
+  uint64_t parent = job->parent;
+  char parent_str[21];
+  ino_to_string(parent_str, parent);
+
+  std::vector<std::pair<std::string, std::string>> args;
+  args.emplace_back("parent", parent_str);
+  args.emplace_back("name", name);
+
+  networkfs_http_call_async(
+      pf.token, "lookup", 1024, args,
+      [job, parent, name](int64_t result, const char* response) {
+        // Response: [entry_type: 8 bytes][ino: 8 bytes]
+        uint64_t entry_type = 0;
+        uint64_t ino = 0;
+        // A local create or unlink since the call started knows better
+        if (result == NFS_SUCCESS) {
+          memcpy(&entry_type, response, sizeof(uint64_t));
+          memcpy(&ino, response + sizeof(uint64_t), sizeof(uint64_t));
+          struct networkfs_dentry dentry = {ino, entry_type};
+          networkfs_dentry_offer(parent, name.c_str(), dentry);
+        } else if (result == NFS_ENOENT_DIR) {
+          struct networkfs_dentry dentry = {0, 0};
+          networkfs_dentry_offer(parent, name.c_str(), dentry);
+        }
+
+        bool read = false;
+        {
+          std::lock_guard<std::mutex> lock(pf.mutex);
+          if (entry_type == DT_REG) {
+            readahead_remember(parent, name, ino);
+            read = job->fetched < pf.budget && !networkfs_slab_fresh(ino) &&
+                   readahead_mark(ino);
+          }
+          if (read) {
+            job->fetched += MAX_FILE_SIZE;
+          } else {
+            pf.inflight--;
+          }
+        }
+        if (read) {
+          prefetch_read(job, ino);
+        }
+      });
+}
+
+/*
+ * Starts fetches of queued items, at most @parallel at a time, and drives
+ * the HTTP engine while any are in flight.
+ */
+static void prefetch_worker() {
+  std::unique_lock<std::mutex> lock(pf.mutex);
+  while (true) {
+    while (!pf.stopping && !pf.jobs.empty() && pf.inflight < pf.parallel) {
+      std::shared_ptr<prefetch_job> job = pf.jobs.front();
+      size_t total = job->files.size() + job->names.size();
+      if (job->next == total || job->fetched >= pf.budget) {
+        pf.jobs.pop_front();
+        continue;
+      }
+      size_t i = job->next++;
+      if (i < job->files.size()) {
+        if (networkfs_slab_fresh(job->files[i])) {
+          continue;
+        }
+        job->fetched += MAX_FILE_SIZE;
+      }
+      pf.inflight++;
+      lock.unlock();
+      if (i < job->files.size()) {
+        prefetch_read(job, job->files[i]);
+      } else {
+        prefetch_lookup(job, job->names[i - job->files.size()]);
+      }
+      lock.lock();
+    }
+
+    if (pf.inflight > 0) {
+      // Drives the HTTP engine in blocking modes; in event loop mode the
+      // loop does, and this only waits for it
+      lock.unlock();
+      networkfs_http_wait();
+      lock.lock();
+      continue;
+    }
+    if (pf.stopping) {
+      return;
+    }
+    pf.wake.wait(lock, [] { return pf.stopping || !pf.jobs.empty(); });
+  }
+}
+
+// Queues @job under the lock.
+static void prefetch_queue(prefetch_job job) {
+  if (!pf.running || pf.stopping ||
+      (job.files.empty() && job.names.empty())) {
+    return;
+  }
+  if (pf.jobs.size() == PREFETCH_QUEUE_MAX) {
+    pf.jobs.pop_front();
+  }
+  pf.jobs.push_back(std::make_shared<prefetch_job>(std::move(job)));
+  pf.wake.notify_all();
+}
+
+void networkfs_prefetch_start(const char* token, unsigned parallel,
+                              size_t budget, unsigned depth) {
+  std::lock_guard<std::mutex> lock(pf.mutex);
+  if (pf.running) {
+    return;
+  }
+  pf.token = token;
+  pf.parallel = std::max(parallel, 1u);
+  pf.budget = budget;
+  pf.depth = depth;
+  pf.stopping = false;
+  pf.running = true;
+  pf.worker = std::thread(prefetch_worker);
+}
+
+void networkfs_prefetch_stop() {
+  {
+    std::lock_guard<std::mutex> lock(pf.mutex);
+    if (!pf.running) {
+      return;
+    }
+    pf.stopping = true;
+    pf.jobs.clear();
+    pf.wake.notify_all();
+  }
+  pf.worker.join();
+
+  std::lock_guard<std::mutex> lock(pf.mutex);
+  pf.running = false;
+  if (pf.predicted > 0) {
+    pf.wasted += pf.speculated.size();
+    pf.speculated.clear();
+    fprintf(stderr,
+            "networkfs: readahead fetched %lu files, %lu used, %lu wasted\n",
+            pf.predicted, pf.used, pf.wasted);
+  }
+}
+
+void networkfs_prefetch_dir(std::vector<uint64_t> files) {
+  std::lock_guard<std::mutex> lock(pf.mutex);
+  prefetch_job job;
+  job.files = std::move(files);
+  prefetch_queue(std::move(job));
+}
+
+void networkfs_readahead_name(uint64_t parent, const char* name,
+                              uint64_t ino) {
+  std::lock_guard<std::mutex> lock(pf.mutex);
+  if (pf.depth == 0) {
+    return;
+  }
+  readahead_remember(parent, name, ino);
+}
+
+/*
+ * Returns @name with its trailing number incremented, keeping its width
+ * ("file009" -> "file010"), or an empty string if it does not end in digits.
+ */
+static std::string readahead_increment(const std::string& name) {
+  size_t start = name.size();
+  while (start > 0 && name[start - 1] >= '0' && name[start - 1] <= '9') {
+    start--;
+  }
+  if (start == name.size()) {
+    return "";
+  }
+  std::string next = name;
+  size_t i = next.size();
+  while (i > start && next[i - 1] == '9') {
+    next[--i] = '0';
+  }
+  if (i == start) {
+    next.insert(start, "1");
+  } else {
+    next[i - 1]++;
+  }
+  return next;
+}
+
+// Name that follows @name in a sequential scan of @dir, or "".
+static std::string readahead_successor(const readahead_dir& dir,
+                                       const std::string& name) {
+  std::string next = readahead_increment(name);
+  if (!next.empty()) {
+    return next;
+  }
+  auto it = dir.names.upper_bound(name);
+  return it == dir.names.end() ? "" : it->first;
+}
+
+void networkfs_readahead_open(uint64_t ino) {
+  std::lock_guard<std::mutex> lock(pf.mutex);
+  if (pf.depth == 0) {
+    return;
+  }
+
+  if (pf.speculated.erase(ino) > 0) {
+    pf.used++;
+    readahead_judge(true);
+  }
+  auto now = prefetch_clock::now();
+  std::erase_if(pf.speculated, [now](const auto& item) {
+    if (item.second + READAHEAD_EXPIRE > now) {
+      return false;
+    }
+    pf.wasted++;
+    readahead_judge(false);
+    return true;
+  });
+
+  auto file = pf.files.find(ino);
+  if (file == pf.files.end()) {
+    return;
+  }
+  uint64_t parent = file->second.first;
+  std::string name = file->second.second;
+  readahead_dir& dir = pf.dirs[parent];
+
+  // Learn the order of this pass for the next one
+  bool sequential = false;
+  if (!dir.last.empty() && dir.last != name) {
+    if (auto prev = dir.names.find(dir.last); prev != dir.names.end()) {
+      dir.next[prev->second] = ino;
+    }
+    sequential = readahead_successor(dir, dir.last) == name;
+  }
+  dir.run = sequential ? dir.run + 1 : 0;
+  dir.last = name;
+
+  // While guesses keep missing, only probe now and then
+  if (pf.throttled && ++pf.skipped < READAHEAD_WINDOW) {
+    return;
+  }
+  pf.skipped = 0;
+
+  prefetch_job job;
+  job.parent = parent;
+  auto want = [&job](uint64_t next) {
+    if (!networkfs_slab_fresh(next) && readahead_mark(next)) {
+      job.files.push_back(next);
+    }
+  };
+
+  // A repeated traversal follows the order seen before
+  uint64_t cur = ino;
+  for (unsigned i = 0; i < pf.depth; i++) {
+    auto it = dir.next.find(cur);
+    if (it == dir.next.end() || it->second == ino) {
+      break;
+    }
+    cur = it->second;
+    want(cur);
+  }
+
+  // A sequential scan goes on with the following names
+  if (job.files.empty() && dir.run > 0) {
+    std::string cur_name = name;
+    for (unsigned i = 0; i < pf.depth; i++) {
+      cur_name = readahead_successor(dir, cur_name);
+      if (cur_name.empty()) {
+        break;
+      }
+      struct networkfs_dentry dentry;
+      if (auto it = dir.names.find(cur_name); it != dir.names.end()) {
+        want(it->second);
+      } else if (networkfs_dentry_get(parent, cur_name.c_str(), &dentry)) {
+        if (dentry.ino == 0 || dentry.entry_type != DT_REG) {
+          break;
+        }
+        want(dentry.ino);
+      } else {
+        job.names.push_back(cur_name);
+      }
+    }
+  }
+
+  prefetch_queue(std::move(job));
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/*
+ * Directory prefetch. Listing a directory is usually followed by opening
+ * its files one after another, each open waiting for its own fs/read. The
+ * prefetcher reads the files of a freshly listed directory in the
+ * background instead, several at a time, and stores them in the content
+ * cache (slab.h) so that those opens are served locally.
+ *
+ * The same thread serves readahead: a predictor fed with names and opens
+ * spots sequential scans (file001, file002, ...) and traversals repeating an
+ * earlier order within a directory, and fetches the files likely to be
+ * opened next. Predictions are counted as used or wasted; while too few of
+ * them are used it only makes an occasional guess.
+ *
+ * All functions are thread-safe.
+ */
+
+/**
+ * networkfs_prefetch_start - start the prefetch thread.
+ * @token:    Filesystem token; must stay valid until
+ *            networkfs_prefetch_stop().
+ * @parallel: Maximum number of reads in flight at once.
+ * @budget:   Stop prefetching a directory once this many bytes of it have
+ *            been fetched.
+ * @depth:    Files to read ahead of a predicted scan, 0 disables readahead.
+ */
+void networkfs_prefetch_start(const char* token, unsigned parallel,
+                              size_t budget, unsigned depth);
+
+/**
+ * networkfs_prefetch_stop - drop queued work, wait for reads in flight and
+ * stop the prefetch thread.
+ *
+ * Reports readahead accounting on stderr. Does nothing if the thread is not
+ * running.
+ */
+void networkfs_prefetch_stop();
+
+/**
+ * networkfs_prefetch_dir - queue the files of a listed directory.
+ * @files: Inodes of its regular files, in listing order.
+ *
+ * Files with fresh cached content are skipped. Does nothing if the prefetch
+ * thread is not running.
+ */
+void networkfs_prefetch_dir(std::vector<uint64_t> files);
+
+/**
+ * networkfs_readahead_name - tell the predictor where a file lives.
+ * @parent: Directory inode.
+ * @name:   Entry name.
+ * @ino:    Inode of the regular file @name resolves to.
+ */
+void networkfs_readahead_name(uint64_t parent, const char* name,
+                              uint64_t ino);
+
+/**
+ * networkfs_readahead_open - tell the predictor a file is being opened.
+ * @ino: Inode number.
+ *
+ * May queue reads of the files expected to be opened next.
+ */
+void networkfs_readahead_open(uint64_t ino);
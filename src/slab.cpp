@@ -0,0 +1,297 @@
+#include "slab.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "inode.h"
+
+#define SLAB_MAGIC 0x62616c5366736e4eULL  // "NnsfSlab"
+#define SLAB_VERSION 1
+
+struct slab_header {
+  uint64_t magic;
+  uint32_t version;
+  uint32_t slots;
+  // Hash of the token, so one filesystem's content is not served to another
+  uint64_t token_hash;
+  // Last value handed out as @slab_slot.used
+  uint64_t clock;
+};
+
+/*
+ * One cached file. A slot is free while @ino is 0; @ino is written last, so
+ * a slot interrupted mid-update is found free on the next open.
+ */
+struct slab_slot {
+  uint64_t ino;
+  uint64_t length;
+  // Wall-clock fetch time in nanoseconds, comparable across mounts
+  int64_t fetched;
+  // Recency stamp from @slab_header.clock; orders the LRU list on open
+  uint64_t used;
+  char data[MAX_FILE_SIZE];
+};
+
+static struct {
+  std::mutex mutex;
+  int fd = -1;
+  size_t length = 0;
+  struct slab_header* header = nullptr;
+  struct slab_slot* slots = nullptr;
+  int64_t ttl = 0;
+  std::unordered_map<uint64_t, uint32_t> index;
+  // Occupied slots, most recently used first
+  std::list<uint32_t> lru;
+  std::vector<std::list<uint32_t>::iterator> lru_pos;
+  std::vector<uint32_t> free;
+} slab;
+
+static int64_t slab_time(std::chrono::system_clock::time_point t) {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             t.time_since_epoch())
+      .count();
+}
+
+static int64_t slab_now() {
+  return slab_time(std::chrono::system_clock::now());
+}
+
+// FNV-1a
+static uint64_t slab_hash(const char* s) {
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  for (; *s != '\0'; s++) {
+    hash = (hash ^ (unsigned char)*s) * 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+static void slab_touch(uint32_t slot) {
+  slab.slots[slot].used = ++slab.header->clock;
+  slab.lru.splice(slab.lru.begin(), slab.lru, slab.lru_pos[slot]);
+}
+
+static void slab_free(uint32_t slot) {
+  slab.index.erase(slab.slots[slot].ino);
+  slab.slots[slot].ino = 0;
+  slab.lru.erase(slab.lru_pos[slot]);
+  slab.free.push_back(slot);
+}
+
+// Rebuilds the index and LRU order from the mapped slots.
+static void slab_load() {
+  uint32_t count = slab.header->slots;
+  slab.lru_pos.assign(count, slab.lru.end());
+
+  std::vector<uint32_t> occupied;
+  for (uint32_t i = 0; i < count; i++) {
+    if (slab.slots[i].ino != 0 && slab.slots[i].length <= MAX_FILE_SIZE) {
+      occupied.push_back(i);
+    } else {
+      slab.slots[i].ino = 0;
+      slab.free.push_back(i);
+    }
+  }
+
+  std::sort(occupied.begin(), occupied.end(), [](uint32_t a, uint32_t b) {
+    return slab.slots[a].used > slab.slots[b].used;
+  });
+  for (uint32_t i : occupied) {
+    if (!slab.index.try_emplace(slab.slots[i].ino, i).second) {
+      // Older copy of an inode cached twice
+      slab.slots[i].ino = 0;
+      slab.free.push_back(i);
+      continue;
+    }
+    slab.lru_pos[i] = slab.lru.insert(slab.lru.end(), i);
+  }
+}
+
+int networkfs_slab_open(const char* path, unsigned slots, double ttl,
+                        const char* token) {
+  std::lock_guard<std::mutex> lock(slab.mutex);
+  if (slab.header != nullptr || slots == 0) {
+    return EINVAL;
+  }
+
+  size_t length = sizeof(slab_header) + (size_t)slots * sizeof(slab_slot);
+  int fd = -1;
+  struct stat st = {};
+  if (path != nullptr) {
+    fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  } else {
+    fd = memfd_create("networkfs-slab", MFD_CLOEXEC);
+  }
+  if (fd < 0) {
+    return errno;
+  }
+  if (fstat(fd, &st) != 0 || ftruncate(fd, length) != 0) {
+    int err = errno;
+    close(fd);
+    return err;
+  }
+  void* map = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED) {
+    int err = errno;
+    close(fd);
+    return err;
+  }
+
+  slab.fd = fd;
+  slab.length = length;
+  slab.header = (struct slab_header*)map;
+  slab.slots = (struct slab_slot*)(slab.header + 1);
+  slab.ttl = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                 std::chrono::duration<double>(std::max(ttl, 0.0)))
+                 .count();
+
+  uint64_t token_hash = slab_hash(token);
+  if ((size_t)st.st_size != length || slab.header->magic != SLAB_MAGIC ||
+      slab.header->version != SLAB_VERSION || slab.header->slots != slots ||
+      slab.header->token_hash != token_hash) {
+    memset(map, 0, length);
+    slab.header->magic = SLAB_MAGIC;
+    slab.header->version = SLAB_VERSION;
+    slab.header->slots = slots;
+    slab.header->token_hash = token_hash;
+  }
+  slab_load();
+  return 0;
+}
+
+void networkfs_slab_close() {
+  std::lock_guard<std::mutex> lock(slab.mutex);
+  if (slab.header == nullptr) {
+    return;
+  }
+  msync(slab.header, slab.length, MS_SYNC);
+  munmap(slab.header, slab.length);
+  close(slab.fd);
+  slab.fd = -1;
+  slab.header = nullptr;
+  slab.slots = nullptr;
+  slab.index.clear();
+  slab.lru.clear();
+  slab.lru_pos.clear();
+  slab.free.clear();
+}
+
+bool networkfs_slab_get(uint64_t ino, std::string* content) {
+  std::lock_guard<std::mutex> lock(slab.mutex);
+  auto it = slab.index.find(ino);
+  if (it == slab.index.end()) {
+    return false;
+  }
+  uint32_t slot = it->second;
+  struct slab_slot& s = slab.slots[slot];
+  if (slab_now() - s.fetched > slab.ttl) {
+    return false;
+  }
+  content->assign(s.data, s.length);
+  slab_touch(slot);
+  return true;
+}
+
+bool networkfs_slab_enabled() {
+  std::lock_guard<std::mutex> lock(slab.mutex);
+  return slab.header != nullptr;
+}
+
+bool networkfs_slab_send(
+    uint64_t ino,
+    const std::function<void(const char* data, size_t length)>& send) {
+  std::lock_guard<std::mutex> lock(slab.mutex);
+  auto it = slab.index.find(ino);
+  if (it == slab.index.end()) {
+    return false;
+  }
+  uint32_t slot = it->second;
+  struct slab_slot& s = slab.slots[slot];
+  if (slab_now() - s.fetched > slab.ttl) {
+    return false;
+  }
+  slab_touch(slot);
+  send(s.data, s.length);
+  return true;
+}
+
+// Stores content of @ino under the lock.
+static void slab_store(uint64_t ino, const char* data, size_t size) {
+  auto it = slab.index.find(ino);
+  if (size > MAX_FILE_SIZE) {
+    if (it != slab.index.end()) {
+      slab_free(it->second);
+    }
+    return;
+  }
+
+  uint32_t slot;
+  if (it != slab.index.end()) {
+    slot = it->second;
+  } else {
+    if (slab.free.empty()) {
+      slab_free(slab.lru.back());
+    }
+    slot = slab.free.back();
+    slab.free.pop_back();
+    slab.lru_pos[slot] = slab.lru.insert(slab.lru.begin(), slot);
+    slab.index.emplace(ino, slot);
+  }
+
+  struct slab_slot& s = slab.slots[slot];
+  s.ino = 0;
+  if (size > 0) {
+    memcpy(s.data, data, size);
+  }
+  s.length = size;
+  s.fetched = slab_now();
+  slab_touch(slot);
+  s.ino = ino;
+}
+
+void networkfs_slab_put(uint64_t ino, const char* data, size_t size) {
+  std::lock_guard<std::mutex> lock(slab.mutex);
+  if (slab.header != nullptr) {
+    slab_store(ino, data, size);
+  }
+}
+
+bool networkfs_slab_fresh(uint64_t ino) {
+  std::lock_guard<std::mutex> lock(slab.mutex);
+  auto it = slab.index.find(ino);
+  return it != slab.index.end() &&
+         slab_now() - slab.slots[it->second].fetched <= slab.ttl;
+}
+
+void networkfs_slab_fill(uint64_t ino, const char* data, size_t size,
+                         std::chrono::system_clock::time_point asked) {
+  std::lock_guard<std::mutex> lock(slab.mutex);
+  if (slab.header == nullptr) {
+    return;
+  }
+  auto it = slab.index.find(ino);
+  if (it != slab.index.end() &&
+      slab.slots[it->second].fetched > slab_time(asked)) {
+    return;
+  }
+  slab_store(ino, data, size);
+}
+
+void networkfs_slab_drop(uint64_t ino) {
+  std::lock_guard<std::mutex> lock(slab.mutex);
+  auto it = slab.index.find(ino);
+  if (it != slab.index.end()) {
+    slab_free(it->second);
+  }
+}
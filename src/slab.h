@@ -0,0 +1,108 @@
+#pragma once
+
+#include <sys/types.h>
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+
+/*
+ * On-disk content cache. File content is capped at MAX_FILE_SIZE, so every
+ * cached file fits one fixed-size slot of a single mmap'd slab file. A slot
+ * records the inode, the content length and when the content was fetched;
+ * content younger than the configured TTL is served without asking the
+ * server. The file outlives the mount, so a remount starts warm. When all
+ * slots are taken the least recently used one is reused.
+ *
+ * The slab is bound to the filesystem token: opening it with another token
+ * empties it. Without a file the slab lives in a memfd and only lasts for
+ * the mount. Until networkfs_slab_open() succeeds every lookup misses.
+ *
+ * All functions are thread-safe.
+ */
+
+/**
+ * networkfs_slab_open - map the slab file, creating it if needed.
+ * @path:  Slab file, or nullptr to keep the slab in memory.
+ * @slots: Capacity in files. A slab of another capacity is emptied.
+ * @ttl:   Seconds fetched content stays fresh.
+ * @token: Filesystem token the content belongs to.
+ *
+ * Return: 0, or a positive errno if the file cannot be opened or mapped.
+ */
+int networkfs_slab_open(const char* path, unsigned slots, double ttl,
+                        const char* token);
+
+/**
+ * networkfs_slab_close - write the slab back and unmap it.
+ *
+ * Does nothing if the slab is not open.
+ */
+void networkfs_slab_close();
+
+/**
+ * networkfs_slab_enabled - whether networkfs_slab_open() has succeeded.
+ */
+bool networkfs_slab_enabled();
+
+/**
+ * networkfs_slab_get - look the content of a file up.
+ * @ino:     Inode number.
+ * @content: Filled on a hit.
+ *
+ * Return: true if @ino is cached and fresh.
+ */
+bool networkfs_slab_get(uint64_t ino, std::string* content);
+
+/**
+ * networkfs_slab_send - pass the cached content of a file on in place.
+ * @ino:  Inode number.
+ * @send: Called with the content as mapped and its length. It runs under
+ *        the slab lock, which keeps the content in place, so it must not
+ *        call back into the slab.
+ *
+ * Counts as a use, like networkfs_slab_get().
+ *
+ * Return: true if @ino is cached and fresh, and @send has run.
+ */
+bool networkfs_slab_send(
+    uint64_t ino,
+    const std::function<void(const char* data, size_t length)>& send);
+
+/**
+ * networkfs_slab_put - remember content just fetched from or stored on the
+ * server.
+ * @ino:  Inode number.
+ * @data: Whole content of the file.
+ * @size: Its length. Content over MAX_FILE_SIZE is not cached.
+ */
+void networkfs_slab_put(uint64_t ino, const char* data, size_t size);
+
+/**
+ * networkfs_slab_fresh - whether a file has fresh cached content.
+ * @ino: Inode number.
+ *
+ * Unlike networkfs_slab_get() this does not count as a use.
+ */
+bool networkfs_slab_fresh(uint64_t ino);
+
+/**
+ * networkfs_slab_fill - remember content fetched in the background.
+ * @ino:   Inode number.
+ * @data:  Whole content of the file.
+ * @size:  Its length.
+ * @asked: When the content was requested from the server.
+ *
+ * Like networkfs_slab_put(), but keeps content stored after @asked, which
+ * may be newer than what the server answered.
+ */
+void networkfs_slab_fill(uint64_t ino, const char* data, size_t size,
+                         std::chrono::system_clock::time_point asked);
+
+/**
+ * networkfs_slab_drop - forget the content of a file.
+ * @ino: Inode number.
+ */
+void networkfs_slab_drop(uint64_t ino);
@@ -0,0 +1,161 @@
+#pragma once
+
+#include <atomic>
+#include <coroutine>
+#include <exception>
+#include <functional>
+#include <optional>
+#include <type_traits>
+#include <utility>
+
+/*
+ * Coroutines for FUSE handlers, so that an operation made of several API
+ * calls reads top to bottom instead of as nested callbacks.
+ *
+ * A networkfs_task<T> is a coroutine producing a T. It starts when awaited
+ * by another coroutine, which resumes once it has finished. A handler starts
+ * its top-level task with detach(), which frees the coroutine when it is
+ * done. Callback-style operations, API calls above all, are awaited through
+ * networkfs_completion.
+ *
+ * A coroutine only suspends when an operation really completes later, as
+ * API calls do in event loop mode; it then goes on on the thread that
+ * completes the operation. Operations that complete right away resume it
+ * in place, so in blocking mode a handler runs on its own thread throughout.
+ */
+
+template <typename T>
+class networkfs_task;
+
+// Hands control back to the awaiting coroutine, or frees a detached one.
+struct networkfs_task_final {
+  bool await_ready() noexcept { return false; }
+
+  template <typename Promise>
+  std::coroutine_handle<> await_suspend(
+      std::coroutine_handle<Promise> handle) noexcept {
+    std::coroutine_handle<> next = handle.promise().continuation;
+    if (handle.promise().detached) {
+      handle.destroy();
+    }
+    return next ? next : std::noop_coroutine();
+  }
+
+  void await_resume() noexcept {}
+};
+
+struct networkfs_task_promise_base {
+  std::coroutine_handle<> continuation;
+  bool detached = false;
+
+  std::suspend_always initial_suspend() noexcept { return {}; }
+  networkfs_task_final final_suspend() noexcept { return {}; }
+  void unhandled_exception() noexcept { std::terminate(); }
+};
+
+template <typename T>
+struct networkfs_task_promise : networkfs_task_promise_base {
+  std::optional<T> value;
+
+  networkfs_task<T> get_return_object() noexcept;
+  void return_value(T result) { value.emplace(std::move(result)); }
+};
+
+template <>
+struct networkfs_task_promise<void> : networkfs_task_promise_base {
+  networkfs_task<void> get_return_object() noexcept;
+  void return_void() noexcept {}
+};
+
+template <typename T = void>
+class [[nodiscard]] networkfs_task {
+ public:
+  using promise_type = networkfs_task_promise<T>;
+
+  explicit networkfs_task(std::coroutine_handle<promise_type> handle)
+      : handle_(handle) {}
+  networkfs_task(networkfs_task&& other) noexcept
+      : handle_(std::exchange(other.handle_, {})) {}
+  networkfs_task& operator=(networkfs_task&&) = delete;
+  ~networkfs_task() {
+    if (handle_) {
+      handle_.destroy();
+    }
+  }
+
+  bool await_ready() const noexcept { return false; }
+
+  std::coroutine_handle<> await_suspend(
+      std::coroutine_handle<> caller) noexcept {
+    handle_.promise().continuation = caller;
+    return handle_;
+  }
+
+  T await_resume() {
+    if constexpr (!std::is_void_v<T>) {
+      return std::move(*handle_.promise().value);
+    }
+  }
+
+  /**
+   * detach - run the task with nobody awaiting it.
+   *
+   * Runs it up to its first suspension and returns. The coroutine frees
+   * itself when it finishes.
+   */
+  void detach() && {
+    std::coroutine_handle<promise_type> handle = std::exchange(handle_, {});
+    handle.promise().detached = true;
+    handle.resume();
+  }
+
+ private:
+  std::coroutine_handle<promise_type> handle_;
+};
+
+template <typename T>
+networkfs_task<T> networkfs_task_promise<T>::get_return_object() noexcept {
+  return networkfs_task<T>(
+      std::coroutine_handle<networkfs_task_promise<T>>::from_promise(*this));
+}
+
+inline networkfs_task<void>
+networkfs_task_promise<void>::get_return_object() noexcept {
+  return networkfs_task<void>(
+      std::coroutine_handle<networkfs_task_promise<void>>::from_promise(
+          *this));
+}
+
+/*
+ * Awaits an operation that reports its outcome, a T, to a callback.
+ * @start begins the operation and must arrange for the callback to be
+ * invoked exactly once, on any thread, possibly before @start returns.
+ */
+template <typename T>
+class [[nodiscard]] networkfs_completion {
+ public:
+  using callback = std::function<void(T)>;
+
+  explicit networkfs_completion(std::function<void(callback)> start)
+      : start_(std::move(start)) {}
+
+  bool await_ready() const noexcept { return false; }
+
+  bool await_suspend(std::coroutine_handle<> handle) {
+    start_([this, handle](T value) {
+      value_.emplace(std::move(value));
+      // Whichever side comes second goes on with the coroutine.
+      if (done_.exchange(true)) {
+        handle.resume();
+      }
+    });
+    return !done_.exchange(true);
+  }
+
+  T await_resume() { return std::move(*value_); }
+
+ private:
+  std::function<void(callback)> start_;
+  std::optional<T> value_;
+  std::atomic<bool> done_ = false;
+};
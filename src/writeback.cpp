@@ -0,0 +1,327 @@
+#include "writeback.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "http.h"
+#include "slab.h"
+#include "util.h"
+
+using writeback_clock = std::chrono::steady_clock;
+
+// Wait before retrying an upload that did not reach the server; doubled on
+// every further failure, up to 64 times that.
+#define WRITEBACK_RETRY std::chrono::seconds(1)
+
+struct pending_write {
+  std::string content;
+  // When the inode became dirty; later saves do not move it.
+  writeback_clock::time_point since;
+  // After a failed upload: not tried again before this.
+  writeback_clock::time_point retry;
+  unsigned failures = 0;
+};
+
+static struct {
+  std::mutex mutex;
+  // Wakes the flusher: new dirty inode, stop, sync or too many dirty bytes.
+  std::condition_variable wake;
+  std::thread flusher;
+  bool running = false;
+  bool stopping = false;
+  const char* token = nullptr;
+  writeback_clock::duration delay;
+  size_t dirty_limit = 0;
+  size_t dirty_bytes = 0;
+  std::map<uint64_t, pending_write> pending;
+  // Inode whose content is being uploaded right now, 0 if none. The server
+  // may not have it yet, so readers still get it from here.
+  uint64_t uploading = 0;
+  pending_write uploading_write;
+  // The file being uploaded has been removed meanwhile.
+  bool uploading_dropped = false;
+  // Inodes that want their pending content uploaded right away.
+  std::vector<uint64_t> urgent;
+  // Callers of networkfs_writeback_sync() waiting for each inode.
+  std::multimap<uint64_t, std::function<void(int err)>> syncs;
+  // Rejected uploads not yet reported through networkfs_writeback_sync()
+  // or networkfs_writeback_error().
+  std::map<uint64_t, int> errors;
+} wb;
+
+/*
+ * Uploads @content of @ino. Returns 0, EIO if the server rejected it, or a
+ * negated errno if it did not get there.
+ */
+static int writeback_upload(uint64_t ino, const std::string& content) {
+  char ino_str[21];
+  ino_to_string(ino_str, ino);
+
+  std::vector<std::pair<std::string, std::string>> args;
+  args.emplace_back("inode", ino_str);
+  args.emplace_back("content", content);
+
+  char response[1024];
+  int64_t result =
+      networkfs_http_call(wb.token, "write", response, sizeof(response), args);
+  if (result < 0) {
+    return (int)result;
+  }
+  return result == NFS_SUCCESS ? 0 : EIO;
+}
+
+/*
+ * Picks the next inode to upload under @lock, or returns 0 if nothing is
+ * due yet and sets @wakeup to when something will be. Everything is due
+ * when stopping or over the dirty limit, except for failed uploads, which
+ * wait for their retry time unless stopping.
+ */
+static uint64_t writeback_next(writeback_clock::time_point now,
+                               writeback_clock::time_point* wakeup) {
+  while (!wb.urgent.empty()) {
+    uint64_t ino = wb.urgent.back();
+    wb.urgent.pop_back();
+    if (wb.pending.contains(ino)) {
+      return ino;
+    }
+  }
+
+  bool all = wb.dirty_bytes > wb.dirty_limit;
+  uint64_t next = 0;
+  *wakeup = writeback_clock::time_point::max();
+  for (const auto& [ino, write] : wb.pending) {
+    auto due = all ? write.since : write.since + wb.delay;
+    due = wb.stopping ? now : std::max(due, write.retry);
+    if (due < *wakeup) {
+      next = ino;
+      *wakeup = due;
+    }
+  }
+  return *wakeup <= now ? next : 0;
+}
+
+/*
+ * Puts @write of @ino back after an upload that did not reach the server,
+ * unless newer content has been stored meanwhile, and schedules a retry.
+ */
+static void writeback_requeue(uint64_t ino, pending_write write) {
+  unsigned failures = write.failures + 1;
+  auto [it, inserted] = wb.pending.try_emplace(ino, std::move(write));
+  if (inserted) {
+    wb.dirty_bytes += it->second.content.size();
+  }
+  auto wait = WRITEBACK_RETRY * (1 << std::min(failures - 1, 6u));
+  it->second.failures = failures;
+  it->second.retry = writeback_clock::now() + wait;
+  fprintf(stderr,
+          "networkfs: write-back of inode %lu failed, retrying in %lds\n", ino,
+          (long)wait.count());
+}
+
+// Takes the unreported upload error of @ino under the lock, 0 if none.
+static int writeback_take_error(uint64_t ino) {
+  auto it = wb.errors.find(ino);
+  if (it == wb.errors.end()) {
+    return 0;
+  }
+  int err = it->second;
+  wb.errors.erase(it);
+  return err;
+}
+
+/*
+ * Answers the syncs waiting for @ino after an upload attempt under @lock.
+ * @failed: the attempt did not reach the server, so they get EIO although
+ * the content is still pending.
+ */
+static void writeback_answer_syncs(std::unique_lock<std::mutex>& lock,
+                                   uint64_t ino, bool failed) {
+  auto [first, last] = wb.syncs.equal_range(ino);
+  if (first == last) {
+    return;
+  }
+  int err = EIO;
+  if (!failed) {
+    if (wb.pending.contains(ino)) {
+      // Stored again during the upload; they wait for that content too.
+      wb.urgent.push_back(ino);
+      return;
+    }
+    err = writeback_take_error(ino);
+  }
+
+  std::vector<std::function<void(int err)>> done;
+  for (auto it = first; it != last; it++) {
+    done.push_back(std::move(it->second));
+  }
+  wb.syncs.erase(first, last);
+  lock.unlock();
+  for (auto& callback : done) {
+    callback(err);
+  }
+  lock.lock();
+}
+
+static void writeback_flusher() {
+  std::unique_lock<std::mutex> lock(wb.mutex);
+  while (true) {
+    writeback_clock::time_point wakeup;
+    uint64_t ino = writeback_next(writeback_clock::now(), &wakeup);
+    if (ino == 0) {
+      if (wb.stopping && wb.pending.empty()) {
+        return;
+      }
+      if (wakeup == writeback_clock::time_point::max()) {
+        wb.wake.wait(lock);
+      } else {
+        wb.wake.wait_until(lock, wakeup);
+      }
+      continue;
+    }
+
+    auto it = wb.pending.find(ino);
+    wb.uploading_write = std::move(it->second);
+    wb.pending.erase(it);
+    wb.dirty_bytes -= wb.uploading_write.content.size();
+    wb.uploading = ino;
+
+    // Only this thread changes @uploading_write, so it can be read
+    // without the lock.
+    lock.unlock();
+    int err = writeback_upload(ino, wb.uploading_write.content);
+    lock.lock();
+
+    wb.uploading = 0;
+    pending_write write = std::move(wb.uploading_write);
+    bool failed = false;
+    if (std::exchange(wb.uploading_dropped, false)) {
+      // Whatever the server made of it, the file is gone.
+    } else if (err == 0) {
+      networkfs_slab_put(ino, write.content.data(), write.content.size());
+    } else if (err < 0 && !wb.stopping) {
+      // Server unreachable or connection lost: the content stays readable
+      // and is tried again later.
+      writeback_requeue(ino, std::move(write));
+      failed = true;
+    } else {
+      // Rejected by the server, which would most likely do so again, or
+      // out of time to retry.
+      fprintf(stderr, "networkfs: write-back of inode %lu failed\n", ino);
+      wb.errors[ino] = EIO;
+    }
+    writeback_answer_syncs(lock, ino, failed);
+  }
+}
+
+void networkfs_writeback_start(const char* token, double delay,
+                               size_t dirty_limit) {
+  std::lock_guard<std::mutex> lock(wb.mutex);
+  if (wb.running) {
+    return;
+  }
+  wb.token = token;
+  wb.delay = std::chrono::duration_cast<writeback_clock::duration>(
+      std::chrono::duration<double>(std::max(delay, 0.0)));
+  wb.dirty_limit = dirty_limit;
+  wb.stopping = false;
+  wb.running = true;
+  wb.flusher = std::thread(writeback_flusher);
+}
+
+void networkfs_writeback_stop() {
+  {
+    std::lock_guard<std::mutex> lock(wb.mutex);
+    if (!wb.running) {
+      return;
+    }
+    wb.stopping = true;
+    wb.wake.notify_all();
+  }
+  wb.flusher.join();
+
+  std::lock_guard<std::mutex> lock(wb.mutex);
+  wb.running = false;
+}
+
+bool networkfs_writeback_enabled() {
+  std::lock_guard<std::mutex> lock(wb.mutex);
+  return wb.running;
+}
+
+void networkfs_writeback_store(uint64_t ino, std::string content) {
+  std::lock_guard<std::mutex> lock(wb.mutex);
+  wb.dirty_bytes += content.size();
+  auto [it, inserted] = wb.pending.try_emplace(ino);
+  if (inserted) {
+    it->second.since = writeback_clock::now();
+  } else {
+    wb.dirty_bytes -= it->second.content.size();
+  }
+  it->second.content = std::move(content);
+
+  // A newly dirty inode may have the earliest deadline
+  if (inserted || wb.dirty_bytes > wb.dirty_limit) {
+    wb.wake.notify_all();
+  }
+}
+
+bool networkfs_writeback_get(uint64_t ino, std::string* content) {
+  std::lock_guard<std::mutex> lock(wb.mutex);
+  auto it = wb.pending.find(ino);
+  if (it != wb.pending.end()) {
+    *content = it->second.content;
+    return true;
+  }
+  if (wb.uploading == ino && !wb.uploading_dropped) {
+    *content = wb.uploading_write.content;
+    return true;
+  }
+  return false;
+}
+
+void networkfs_writeback_sync(uint64_t ino,
+                              std::function<void(int err)> done) {
+  std::unique_lock<std::mutex> lock(wb.mutex);
+  if (!wb.pending.contains(ino) && wb.uploading != ino) {
+    int err = writeback_take_error(ino);
+    lock.unlock();
+    done(err);
+    return;
+  }
+  if (wb.pending.contains(ino)) {
+    wb.urgent.push_back(ino);
+    wb.wake.notify_all();
+  }
+  wb.syncs.emplace(ino, std::move(done));
+}
+
+int networkfs_writeback_error(uint64_t ino) {
+  std::lock_guard<std::mutex> lock(wb.mutex);
+  return writeback_take_error(ino);
+}
+
+void networkfs_writeback_drop(uint64_t ino) {
+  std::unique_lock<std::mutex> lock(wb.mutex);
+  if (auto it = wb.pending.find(ino); it != wb.pending.end()) {
+    wb.dirty_bytes -= it->second.content.size();
+    wb.pending.erase(it);
+  }
+  std::erase(wb.urgent, ino);
+  wb.errors.erase(ino);
+  if (wb.uploading == ino) {
+    // The flusher answers the syncs once the upload is over.
+    wb.uploading_dropped = true;
+    return;
+  }
+  writeback_answer_syncs(lock, ino, false);
+}
@@ -0,0 +1,90 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+
+/*
+ * Write-back store. In write-back mode flush hands the content of a file to
+ * this store instead of uploading it. A background thread uploads each
+ * dirty inode once it has been dirty for the configured delay, or sooner
+ * when too many bytes are waiting. Saving the same inode again before then
+ * replaces the pending content, so repeated saves cost a single fs/write.
+ * Content that does not reach the server stays pending and is retried with
+ * growing pauses; content the server rejects is dropped and the error is
+ * kept for the next sync or flush of the inode.
+ *
+ * All functions are thread-safe.
+ */
+
+/**
+ * networkfs_writeback_start - start the background flusher.
+ * @token:       Filesystem token; must stay valid until
+ *               networkfs_writeback_stop().
+ * @delay:       Seconds an inode may stay dirty before it is uploaded.
+ * @dirty_limit: Upload everything right away once more than this many
+ *               bytes are pending.
+ */
+void networkfs_writeback_start(const char* token, double delay,
+                               size_t dirty_limit);
+
+/**
+ * networkfs_writeback_stop - upload everything pending and stop the flusher.
+ *
+ * Does nothing if the flusher is not running.
+ */
+void networkfs_writeback_stop();
+
+/**
+ * networkfs_writeback_enabled - whether the flusher is running.
+ */
+bool networkfs_writeback_enabled();
+
+/**
+ * networkfs_writeback_store - queue new content of a file for upload.
+ * @ino:     Inode number.
+ * @content: Whole content of the file.
+ */
+void networkfs_writeback_store(uint64_t ino, std::string content);
+
+/**
+ * networkfs_writeback_get - content queued but not yet uploaded.
+ * @ino:     Inode number.
+ * @content: Filled with the latest stored content on success.
+ *
+ * Return: true if @ino has content that the server may not have yet.
+ */
+bool networkfs_writeback_get(uint64_t ino, std::string* content);
+
+/**
+ * networkfs_writeback_sync - upload pending content of a file now.
+ * @ino:  Inode number.
+ * @done: Invoked once content stored for @ino so far is on the server, or
+ *        once an attempt to upload it right away has failed to reach the
+ *        server; the content then stays pending. Runs before this returns
+ *        if there is nothing to upload, otherwise on the flusher thread.
+ *
+ * @done gets 0, EIO if the upload failed, or a positive errno if an upload
+ * of @ino was rejected since the error was last reported.
+ */
+void networkfs_writeback_sync(uint64_t ino, std::function<void(int err)> done);
+
+/**
+ * networkfs_writeback_error - take the error of a rejected upload.
+ * @ino: Inode number.
+ *
+ * Return: a positive errno if an upload of @ino was rejected since the
+ * error was last reported, otherwise 0.
+ */
+int networkfs_writeback_error(uint64_t ino);
+
+/**
+ * networkfs_writeback_drop - forget a removed file.
+ * @ino: Inode number.
+ *
+ * Discards content of @ino not uploaded yet and any unreported error, so
+ * that the flusher does not write to an inode the server no longer has.
+ * Syncs waiting for @ino return 0.
+ */
+void networkfs_writeback_drop(uint64_t ino);
@@ -91,6 +91,52 @@ TEST_F(BaseTest, CreateDirectories) {
   ASSERT_EQ(response_nested.entry_type, EntryType::DIRECTORY);
 }
 
+TEST_F(BaseTest, CreateAfterNotFound) {
+  ASSERT_FALSE(fs::exists({"test"}));
+  ASSERT_FALSE(fs::exists({"dir"}));
+
+  {
+    std::fstream fs;
+    fs.open("test", std::ios::out);
+    ASSERT_FALSE(fs.fail());
+    fs.close();
+    ASSERT_FALSE(fs.fail());
+  }
+  ASSERT_NO_THROW(fs::create_directory("dir"));
+
+  ASSERT_TRUE(fs::is_regular_file({"test"}));
+  ASSERT_TRUE(fs::is_directory({"dir"}));
+
+  lookup_response response = nfs.lookup(ROOT_INO, "test");
+  ASSERT_EQ(response.status, 0);
+  ASSERT_EQ(response.entry_type, EntryType::FILE);
+}
+
+TEST_F(BaseTest, CreateInListedDirectory) {
+  ino_t dir = nfs.create(ROOT_INO, "dir", EntryType::DIRECTORY).ino;
+  nfs.create(dir, "file", EntryType::FILE);
+
+  std::set<std::string> expected_files{"file"};
+  ASSERT_EQ(list_directory({"dir"}), expected_files);
+  ASSERT_FALSE(fs::exists({"dir/test"}));
+
+  {
+    std::fstream fs;
+    fs.open("dir/test", std::ios::out);
+    ASSERT_FALSE(fs.fail());
+    fs.close();
+    ASSERT_FALSE(fs.fail());
+  }
+
+  ASSERT_TRUE(fs::is_regular_file({"dir/test"}));
+  expected_files.insert("test");
+  ASSERT_EQ(list_directory({"dir"}), expected_files);
+
+  ASSERT_NO_THROW(fs::remove("dir/test"));
+  ASSERT_FALSE(fs::exists({"dir/test"}));
+  ASSERT_NE(nfs.lookup(dir, "test").status, 0);
+}
+
 TEST_F(BaseTest, TooManyFiles) {
   nfs.clear();
 
@@ -46,6 +46,32 @@ TEST_F(FileTest, ReadLong) {
   fs.close();
 }
 
+TEST_F(FileTest, Size) {
+  ASSERT_EQ(fs::file_size("file1"), 22);
+
+  nfs.clear();
+  ino_t file = nfs.create(ROOT_INO, "file", EntryType::FILE).ino;
+  nfs.write(file, std::string(512, 'a'));
+
+  // Without opening the file: one read tells the size, and the attribute
+  // cache answers from then on
+  ASSERT_EQ(fs::file_size("file"), 512);
+
+  // Changed behind our back; the old size shows that nobody asked the server
+  nfs.write(file, "short");
+  ASSERT_EQ(fs::file_size("file"), 512);
+
+  {
+    std::fstream fs;
+    fs.open("file", std::ios::out | std::ios::trunc);
+    ASSERT_FALSE(fs.fail());
+    fs << "hello";
+    fs.close();
+  }
+
+  ASSERT_EQ(fs::file_size("file"), 5);
+}
+
 TEST_F(FileTest, ReadSeek) {
   std::fstream fs;
   fs.open("file1");
@@ -107,6 +133,28 @@ TEST_F(FileTest, ReadSpecial) {
   fs.close();
 }
 
+TEST_F(FileTest, ReadOnlyClose) {
+  ino_t ino = nfs.lookup(ROOT_INO, "file1").ino;
+
+  int fd = open("file1", O_RDONLY);
+  ASSERT_NE(fd, -1);
+
+  char buffer[64];
+  ssize_t bytes = read(fd, buffer, sizeof(buffer));
+  ASSERT_EQ(std::string(buffer, bytes), "hello world from file1");
+
+  // Changed behind our back: neither fsync nor close may upload the copy
+  // that was read.
+  nfs.write(ino, "changed");
+  ASSERT_EQ(fsync(fd), 0);
+  ASSERT_EQ(close(fd), 0);
+
+  read_response file = nfs.read(ino);
+  std::string actual_content =
+      std::string(file.content, file.content + file.content_length);
+  ASSERT_EQ(actual_content, "changed");
+}
+
 TEST_F(FileTest, WriteNewFile) {
   nfs.clear();
 
@@ -213,6 +261,25 @@ TEST_F(FileTest, WriteAppending) {
   ASSERT_EQ(actual_content, expected_content);
 }
 
+TEST_F(FileTest, WriteGrownFile) {
+  ino_t ino = nfs.lookup(ROOT_INO, "file1").ino;
+  ASSERT_EQ(fs::file_size("file1"), 22);
+
+  // Grows behind our back while the old size is still cached
+  nfs.write(ino, "hello world from file1 and more");
+
+  int fd = open("file1", O_WRONLY);
+  ASSERT_NE(fd, -1);
+  char message[] = "HELLO WORLD FROM FILE1";
+  ASSERT_EQ(pwrite(fd, message, strlen(message), 0), strlen(message));
+  ASSERT_EQ(close(fd), 0);
+
+  read_response file = nfs.read(ino);
+  std::string actual_content =
+      std::string(file.content, file.content + file.content_length);
+  ASSERT_EQ(actual_content, "HELLO WORLD FROM FILE1 and more");
+}
+
 TEST_F(FileTest, WriteSeek) {
   nfs.clear();
   ino_t ino = nfs.create(ROOT_INO, "file", EntryType::FILE).ino;
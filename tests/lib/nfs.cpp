@@ -14,7 +14,7 @@ namespace fs = std::filesystem;
 
 NfsBucket::NfsBucket() : client("nerc.itmo.ru", 80) {}
 
-void NfsBucket::initialize() {
+void NfsBucket::initialize(const std::vector<std::string>& options) {
   auto response = issue();
   this->token_ =
       std::string(response.token, response.token + sizeof(response.token));
@@ -26,8 +26,14 @@ void NfsBucket::initialize() {
   pid_t pid = fork();
   if (pid == 0) {
     setenv("NETWORKFS_TOKEN", this->token_.c_str(), 1);
-    execl("./networkfs", "./networkfs", "-f", TEST_ROOT.c_str(), NULL);
-    perror("execl failed");
+    std::vector<const char*> argv{"./networkfs", "-f"};
+    for (const auto& option : options) {
+      argv.push_back(option.c_str());
+    }
+    argv.push_back(TEST_ROOT.c_str());
+    argv.push_back(NULL);
+    execv("./networkfs", (char* const*)argv.data());
+    perror("execv failed");
     exit(1);
   } else if (pid > 0) {
     this->fuse_pid = pid;
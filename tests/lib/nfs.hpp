@@ -4,6 +4,7 @@
 #include <httplib.h>
 
 #include <string>
+#include <vector>
 
 #include "util.hpp"
 
@@ -66,7 +67,8 @@ class NfsBucket {
 
   const std::string token() const;
 
-  void initialize();
+  // Mounts the filesystem, with extra command line @options if any.
+  void initialize(const std::vector<std::string>& options = {});
   void unmount(bool);
 
   ~NfsBucket();
@@ -14,12 +14,14 @@ class NfsTest : public testing::Test {
  public:
   fs::path previous_path;
   NfsBucket nfs;
+  // Extra command line options for the mount.
+  std::vector<std::string> options;
 
   NfsTest() : nfs() {};
 
  protected:
   void SetUp() override {
-    nfs.initialize();
+    nfs.initialize(options);
     std::cerr << "Token for this run: " << nfs.token() << std::endl;
     previous_path = fs::current_path();
     fs::current_path(TEST_ROOT);
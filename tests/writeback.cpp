@@ -0,0 +1,100 @@
+#include <fcntl.h>
+#include <gtest/gtest.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <thread>
+
+#include "lib/test.hpp"
+#include "lib/util.hpp"
+
+namespace fs = std::filesystem;
+
+class WritebackTest : public NfsTest {
+ public:
+  // Long enough for nothing to be uploaded on its own during a test.
+  WritebackTest() { options = {"-o", "writeback,writeback_delay=60"}; }
+};
+
+TEST_F(WritebackTest, ReadAfterClose) {
+  std::string content = "hello-world";
+
+  std::fstream fs;
+  fs.open("file1", std::ios::out | std::ios::trunc);
+  ASSERT_FALSE(fs.fail());
+  fs << content;
+  fs.close();
+  ASSERT_FALSE(fs.fail());
+
+  // Not uploaded yet
+  ino_t ino = nfs.lookup(ROOT_INO, "file1").ino;
+  read_response file = nfs.read(ino);
+  std::string server_content =
+      std::string(file.content, file.content + file.content_length);
+  ASSERT_EQ(server_content, "hello world from file1");
+
+  fs.open("file1", std::ios::in);
+  ASSERT_FALSE(fs.fail());
+
+  std::stringstream buffer;
+  buffer << fs.rdbuf();
+  ASSERT_EQ(buffer.str(), content);
+
+  fs.close();
+}
+
+TEST_F(WritebackTest, Synchronize) {
+  int fd = open("file1", O_WRONLY | O_TRUNC);
+  ASSERT_NE(fd, -1);
+
+  char message[] = "hello-world";
+  std::size_t written = 0;
+  while (written < strlen(message)) {
+    int bytes = write(fd, message + written, strlen(message) - written);
+    ASSERT_NE(bytes, -1);
+    written += bytes;
+  }
+
+  ASSERT_EQ(fsync(fd), 0);
+
+  ino_t ino = nfs.lookup(ROOT_INO, "file1").ino;
+  read_response file = nfs.read(ino);
+  std::string actual_content =
+      std::string(file.content, file.content + file.content_length);
+  ASSERT_EQ(actual_content, "hello-world");
+
+  ASSERT_EQ(close(fd), 0);
+}
+
+class WritebackUnlinkTest : public NfsTest {
+ public:
+  WritebackUnlinkTest() { options = {"-o", "writeback,writeback_delay=0.2"}; }
+};
+
+TEST_F(WritebackUnlinkTest, NoUploadAfterUnlink) {
+  ino_t ino = nfs.lookup(ROOT_INO, "file1").ino;
+
+  std::fstream fs;
+  fs.open("file1", std::ios::out | std::ios::trunc);
+  ASSERT_FALSE(fs.fail());
+  fs << "hello-world";
+  fs.close();
+  ASSERT_FALSE(fs.fail());
+
+  ASSERT_NO_THROW(fs::remove("file1"));
+
+  // Well past the write-back delay
+  std::this_thread::sleep_for(std::chrono::seconds(1));
+
+  // The server either has forgotten the inode or still has its old content.
+  read_response file = nfs.read(ino);
+  if (file.status == 0) {
+    std::string server_content =
+        std::string(file.content, file.content + file.content_length);
+    ASSERT_EQ(server_content, "hello world from file1");
+  }
+}